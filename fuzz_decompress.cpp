@@ -0,0 +1,72 @@
+// Simple byte-aligned binary arithmetic coder - public domain - Fabian 'ryg' Giesen 2015
+//
+// libFuzzer target for decompressing damaged input. Build with
+// "make fuzz" (needs Clang).
+//
+// Each input gets decompressed twice. First as-is, which is what
+// finds holes in the header and seek table parsing. Then the input
+// gets compressed, the result damaged with bit flips and truncation,
+// and that gets decompressed; that's what gets the damage past the
+// checksums and into the block decoders. Either way, decompressing
+// must not crash, and if it says it worked, it has to be right.
+
+#include "mini_arith.h"
+
+using namespace mini_arith;
+
+// Small deterministic PRNG, so a crash reproduces from its input.
+static uint32_t fuzz_rand(uint32_t &state)
+{
+    state = state * 1664525 + 1013904223;
+    return state >> 8;
+}
+
+// Decompress "coded" both ways (into memory and through a sink); if
+// either claims success, the output has to match "expect" (when given).
+static void check_decompress(ByteVec const &coded, ByteVec const *expect)
+{
+    uint8_t const *data = coded.empty() ? 0 : &coded[0];
+    uint64_t const max_output = 1 << 24;
+
+    ByteVec out;
+    if (try_decompress(out, data, coded.size(), 1, max_output) == kDecodeOk && expect && out != *expect)
+        abort();
+
+    ByteVec streamed;
+    VecSink sink(streamed);
+    if (try_decompress(sink, data, coded.size(), 1, max_output) == kDecodeOk && expect && streamed != *expect)
+        abort();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size)
+{
+    check_decompress(ByteVec(data, data + size), 0);
+
+    // Control bytes: backend, block size, amount of damage, PRNG seed.
+    if (size < 4)
+        return 0;
+
+    static BlockBackend const backends[4] = { kBackendArith, kBackendRans, kBackendLz, kBackendAuto };
+    BlockBackend backend = backends[data[0] & 3];
+    size_t block_size = (size_t)64 << (data[1] & 7);
+    int flips = data[2] & 7;
+    bool truncate = (data[2] & 8) != 0;
+    uint32_t seed = data[3];
+
+    ByteVec source(data + 4, data + size), coded;
+    compress(coded, source.empty() ? 0 : &source[0], source.size(), block_size, 1, backend);
+    check_decompress(coded, &source);
+
+    for (int i = 0; i < flips; ++i)
+    {
+        size_t bit = fuzz_rand(seed) % (coded.size() * 8);
+        coded[bit >> 3] ^= (uint8_t)(1 << (bit & 7));
+    }
+    if (truncate)
+        coded.resize(fuzz_rand(seed) % coded.size());
+
+    // With damage, success is only OK if the damage didn't change the
+    // output (e.g. a flipped bit the decoder never looks at).
+    check_decompress(coded, &source);
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Simple byte-aligned binary arithmetic coder - public domain - Fabian 'ryg' Giesen 2015
+//
+// libFuzzer target for encode -> decode round trips. Build with
+// "make fuzz" (needs Clang).
+//
+// The fuzzer's input is the data to code, after a couple of control
+// bytes that pick block size, backend and LZ settings. Everything that
+// gets encoded has to decode back to exactly the input: through the
+// container, through a bare bit tree (per symbol and batched), and
+// through LZ with a small window, so matches hit the window edge.
+
+#include "mini_arith.h"
+
+using namespace mini_arith;
+
+typedef BitTreeModel<BinShiftModel<5>, 8> FuzzByteModel;
+
+static void check(bool ok)
+{
+    if (!ok)
+        abort();
+}
+
+static void roundtrip_container(uint8_t const *data, size_t size, size_t block_size, BlockBackend backend)
+{
+    ByteVec coded, decoded;
+    compress(coded, data, size, block_size, 1, backend);
+    check(try_decompress(decoded, &coded[0], coded.size(), 1) == kDecodeOk);
+    check(decoded.size() == size && (size == 0 || memcmp(&decoded[0], data, size) == 0));
+}
+
+static void roundtrip_bit_tree(uint8_t const *data, size_t size)
+{
+    ByteVec coded;
+    {
+        BinArithEncoder coder(coded);
+        FuzzByteModel model;
+        for (size_t i = 0; i < size; ++i)
+            model.encode(coder, data[i]);
+    }
+
+    ByteVec decoded(size + 1);
+    {
+        BinArithDecoder coder(coded.empty() ? 0 : &coded[0], coded.size());
+        FuzzByteModel model;
+        for (size_t i = 0; i < size; ++i)
+            decoded[i] = (uint8_t) model.decode(coder);
+        check(!coder.overrun() && memcmp(&decoded[0], data, size) == 0);
+    }
+    {
+        BinArithDecoder coder(coded.empty() ? 0 : &coded[0], coded.size());
+        FuzzByteModel model;
+        decode_block(model, coder, &decoded[0], size);
+        check(!coder.overrun() && memcmp(&decoded[0], data, size) == 0);
+    }
+}
+
+static void roundtrip_lz(uint8_t const *data, size_t size, LzOptions const &opts)
+{
+    ByteVec coded, decoded(size + 1);
+    lz_encode(coded, data, size, opts);
+    check(lz_decode(&decoded[0], size, &coded[0], coded.size()));
+    check(memcmp(&decoded[0], data, size) == 0);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size)
+{
+    if (size < 2)
+        return 0;
+
+    static BlockBackend const backends[4] = { kBackendArith, kBackendRans, kBackendLz, kBackendAuto };
+    size_t block_size = (size_t)64 << (data[0] & 7);
+    BlockBackend backend = backends[(data[0] >> 3) & 3];
+
+    LzOptions lz_opts;
+    lz_opts.window_bits = kLzMinWindowBits + (data[1] & 3);
+    lz_opts.max_chain = 1 + (data[1] >> 2);
+    lz_opts.nice_len = 8 + (data[1] >> 2);
+
+    data += 2;
+    size -= 2;
+    roundtrip_container(data, size, block_size, backend);
+    roundtrip_bit_tree(data, size);
+    roundtrip_lz(data, size, lz_opts);
+    return 0;
+}
@@ -1,221 +1,234 @@
 // Simple byte-aligned binary arithmetic coder (Ilya Muravyov's variant) - public domain - Fabian 'ryg' Giesen 2015
 //
 // Written for clarity not speed!
+//
+// Examples, benchmarks and the command-line tool. The coder itself
+// lives in mini_arith.h.
 
 #define _CRT_SECURE_NO_WARNINGS
-#include <stdio.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <assert.h>
-#include <math.h>
-#include <vector>
-
-// Probabilities are expressed in fixed point, with kProbBits bits of
-// resolution. No need to go overboard with this.
-static int const kProbBits = 12;
-static uint32_t const kProbMax = 1u << kProbBits;
-
-// Type used for buffers.
-typedef std::vector<uint8_t> ByteVec;
-
-// Binary arithmetic encoder (Ilya Muravyov's variant)
-// Encodes/decodes a string of binary (0/1) events with
-// probabilities that are not 1/2.
-//
-// This code is written for clarity, not performance.
-class BinArithEncoder
-{
-    uint32_t lo, hi;
-    ByteVec &bytes;
+#include "mini_arith.h"
+#include <chrono>
 
-    // noncopyable
-    BinArithEncoder(BinArithEncoder const &);
-    BinArithEncoder &operator =(BinArithEncoder const &);
+// For memory-mapped files
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-public:
-    // Initialize
-    explicit BinArithEncoder(ByteVec &target) : lo(0), hi(~0u), bytes(target) { }
+using namespace mini_arith;
 
-    // Finish encoding - flushes remaining codeword
-    ~BinArithEncoder()
-    {
-        for (int i = 0; i < 4; ++i)
-        {
-            bytes.push_back(lo >> 24);
-            lo <<= 8;
-        }
-    }
+// ---- Random utility code
 
-    // Encode a binary symbol "bit" with the probability of a 1 being "prob".
-    // Note that prob=0 (or prob=1<<kProbBits) really mean that a 1 (or 0,
-    // respectively) cannot occur!
-    void encode(int bit, uint32_t prob)
-    {
-        // Midpoint of active probability interval subdivided via prob
-        uint32_t x = lo + ((uint64_t(hi - lo) * prob) >> kProbBits);
+static double log_2(double x)
+{
+    return log(x) / log(2.0);
+}
 
-        if (bit)
-            hi = x;
-        else
-            lo = x + 1;
+// Wall-clock time in seconds, for throughput numbers.
+static double timer()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-        // Renormalize: when top byte of lo/hi is same, shift it out.
-        while ((lo ^ hi) < (1u << 24))
-        {
-            bytes.push_back(lo >> 24);
-            lo <<= 8;
-            hi = (hi << 8) | 0xff;
-        }
-    }
-};
+static bool read_file(char const *filename, ByteVec &out)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return false;
+
+    fseek(f, 0, SEEK_END);
+    out.resize(ftell(f));
+    fseek(f, 0, SEEK_SET);
+    if (!out.empty())
+        fread(&out[0], 1, out.size(), f);
+    fclose(f);
+    return true;
+}
 
-// Corresponding decoder.
-class BinArithDecoder
+// Read-only view of a whole file. Memory-mapped where possible, so
+// large inputs don't get copied; otherwise (pipes, stdin, mmap failing)
+// read into a buffer. Name "-" means stdin.
+class InputFile
 {
-    uint32_t code, lo, hi;
-    ByteVec const &bytes;
-    size_t read_pos;
+    uint8_t const *ptr;
+    size_t len;
+    ByteVec buf; // when not mapped
+#ifdef _WIN32
+    HANDLE mapping;
+#else
+    bool mapped;
+#endif
 
     // noncopyable
-    BinArithDecoder(BinArithDecoder const &);
-    BinArithDecoder &operator =(BinArithDecoder const &);
+    InputFile(InputFile const &);
+    InputFile &operator =(InputFile const &);
 
-public:
-    // Start decoding
-    explicit BinArithDecoder(ByteVec const &source)
-        : lo(0), hi(~0u), bytes(source), read_pos(0)
+    bool read_all(FILE *f)
     {
-        code = 0;
-        for (int i = 0; i < 4; ++i)
-            code = (code << 8) | bytes[read_pos++];
+        static size_t const kChunk = 1 << 20;
+        size_t used = 0;
+        for (;;)
+        {
+            buf.resize(used + kChunk);
+            size_t got = fread(&buf[used], 1, kChunk, f);
+            used += got;
+            if (got < kChunk)
+                break;
+        }
+        buf.resize(used);
+        ptr = buf.empty() ? 0 : &buf[0];
+        len = used;
+        return !ferror(f);
     }
 
-    // Decode a binary symbol with the probability of a 1 being "prob".
-    int decode(uint32_t prob)
+    bool map(char const *filename)
     {
-        int bit;
+#ifdef _WIN32
+        HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
 
-        // Midpoint of active probability interval subdivided via prob
-        uint32_t x = lo + ((uint64_t(hi - lo) * prob) >> kProbBits);
-
-        if (code <= x)
+        LARGE_INTEGER file_size;
+        bool ok = GetFileSizeEx(file, &file_size) != 0 && (uint64_t)file_size.QuadPart <= SIZE_MAX;
+        if (ok && file_size.QuadPart > 0)
         {
-            hi = x;
-            bit = 1;
+            mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+            ptr = mapping ? (uint8_t const *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : 0;
+            ok = ptr != 0;
         }
-        else
+        len = ok ? (size_t)file_size.QuadPart : 0;
+        CloseHandle(file);
+        return ok;
+#else
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size <= SIZE_MAX;
+        if (ok && st.st_size > 0)
         {
-            lo = x + 1;
-            bit = 0;
+            void *p = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = p != MAP_FAILED;
+            if (ok)
+            {
+                ptr = (uint8_t const *)p;
+                mapped = true;
+            }
         }
+        len = ok ? (size_t)st.st_size : 0;
+        close(fd);
+        return ok;
+#endif
+    }
 
-        // Renormalize
-        while ((lo ^ hi) < (1u << 24))
+    void unmap()
+    {
+#ifdef _WIN32
+        if (mapping)
         {
-            code = (code << 8) | bytes[read_pos++];
-            lo <<= 8;
-            hi = (hi << 8) | 0xff;
+            UnmapViewOfFile(ptr);
+            CloseHandle(mapping);
+            mapping = 0;
         }
-
-        return bit;
+#else
+        if (mapped)
+        {
+            munmap((void *)ptr, len);
+            mapped = false;
+        }
+#endif
+        ptr = 0;
+        len = 0;
     }
-};
-
-// ---- A few basic models
-
-// NOTE: Again, this is written for clarity and ease of tinkering.
-// In practice, you will write more direct code for these once you've
-// figured out your coding structure.
-
-// Adaptive binary model. These are pretty good!
-// Lower Inertia = faster.
-//
-// You typically build more sophisticated models out of these
-// by having lots of them and choosing the active model based on
-// context.
-template<int Inertia>
-struct BinShiftModel
-{
-    uint16_t prob;
 
-    BinShiftModel() : prob(kProbMax / 2) {}
+public:
+#ifdef _WIN32
+    InputFile() : ptr(0), len(0), mapping(0) { }
+#else
+    InputFile() : ptr(0), len(0), mapped(false) { }
+#endif
+    ~InputFile() { unmap(); }
 
-    void encode(BinArithEncoder &enc, int bit)
+    bool open_file(char const *filename)
     {
-        enc.encode(bit, prob);
-        adapt(bit);
-    }
+        unmap();
+        if (strcmp(filename, "-") == 0)
+        {
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            return read_all(stdin);
+        }
 
-    int decode(BinArithDecoder &dec)
-    {
-        int bit = dec.decode(prob);
-        adapt(bit);
-        return bit;
-    }
+        if (map(filename))
+            return true;
 
-    void adapt(int bit)
-    {
-        // Note prob never his 0 or kProbMax with this update rule!
-        if (bit)
-            prob += (kProbMax - prob) >> Inertia;
-        else
-            prob -= prob >> Inertia;
+        // Not something we can map; just read it.
+        FILE *f = fopen(filename, "rb");
+        if (!f)
+            return false;
+        bool ok = read_all(f);
+        fclose(f);
+        return ok;
     }
+
+    uint8_t const *data() const { return ptr; }
+    size_t size() const { return len; }
 };
 
-// BitTree model. A tree-shaped cascade of BinShiftModels.
-// This is the de-facto standard way to build a multi-symbol coder
-// (values with NumBits bits) out of binary models.
-//
-// LZMA (as in 7zip/xz) uses this type of model (backed by a BinShiftModel
-// as above) for its literals.
-template<typename BitModel, int NumBits>
-struct BitTreeModel
+// Output file ("-" for stdout), for use with a StreamSink.
+struct OutputFile
 {
-    static size_t const kNumSyms = 1 << NumBits;
-    static size_t const kMSB = kNumSyms / 2;
+    FILE *f;
+    bool failed;
+    uint64_t written;
 
-    BitModel model[kNumSyms - 1];
+    OutputFile() : f(0), failed(false), written(0) { }
+    ~OutputFile() { close(); }
 
-    void encode(BinArithEncoder &enc, size_t value)
+    bool open_file(char const *filename)
     {
-        assert(value < kNumSyms);
-
-        // The first bit sent is the MSB of the value and coded without context
-        // Second bit is the bit below the MSB, using the value of the MSB as context
-        // and so forth.
-        //
-        // 1 + 2 + 4 + ... = 2^NumBits - 1 contexts.
-        // Numbering the MSB context 1 and then shifting in the coded bits from the
-        // bottom is a convenient way to index them. (So ctx is 1-based)
-        size_t ctx = 1;
-        while (ctx < kNumSyms)
+        if (strcmp(filename, "-") == 0)
         {
-            int bit = (value & kMSB) != 0;
-            value += value; // shift value by 1 for next iter
-            model[ctx - 1].encode(enc, bit);
-            ctx += ctx + bit; // shift in "bit" into context
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            f = stdout;
         }
+        else
+            f = fopen(filename, "wb");
+        return f != 0;
     }
 
-    size_t decode(BinArithDecoder &dec)
+    // Returns false if anything failed to write.
+    bool close()
     {
-        // Corresponding decoder is nice and easy:
-        size_t ctx = 1;
-        while (ctx < kNumSyms)
-            ctx += ctx + model[ctx - 1].decode(dec);
+        if (f && fflush(f) != 0)
+            failed = true;
+        if (f && f != stdout && fclose(f) != 0)
+            failed = true;
+        f = 0;
+        return !failed;
+    }
 
-        return ctx - kNumSyms;
+    static void write_func(void *user, uint8_t const *data, size_t size)
+    {
+        OutputFile *out = (OutputFile *)user;
+        if (!out->failed && fwrite(data, 1, size, out->f) != size)
+            out->failed = true;
+        out->written += size;
     }
 };
 
-// ---- Random utility code
-
-static double log_2(double x)
-{
-    return log(x) / log(2.0);
-}
-
 // ---- Some examples
 
 static void example_static()
@@ -240,7 +253,7 @@ static void example_static()
     {
         double p = kProbOne / (double)kProbMax;
         double entropy_bits_per_sym = -p * log_2(p) - (1.0 - p) * log_2(1.0 - p);
-        printf("static size: %d bytes - entropy: %.2f bytes\n", coded.size(), source.size() * entropy_bits_per_sym / 8.0);
+        printf("static size: %d bytes - entropy: %.2f bytes\n", (int)coded.size(), source.size() * entropy_bits_per_sym / 8.0);
     }
 
     // Decode it
@@ -282,7 +295,7 @@ static void example_dynamic()
             model.encode(coder, source[i]);
     }
 
-    printf("dynamic size: %d bytes\n", coded.size());
+    printf("dynamic size: %d bytes\n", (int)coded.size());
 
     // Decode it
     ByteVec decoded;
@@ -305,37 +318,341 @@ static void example_multisymbol()
     // Let's get meta and use this source code as our source!
     typedef BitTreeModel<BinShiftModel<5>, 8> ByteModel;
     ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
 
+    // Encode it
+    ByteVec coded;
     {
-        FILE *f = fopen("main.cpp", "rb");
-        if (!f)
-            return;
+        BinArithEncoder coder(coded);
+        ByteModel model;
+        for (size_t i = 0; i < source.size(); ++i)
+            model.encode(coder, source[i]);
+    }
 
-        fseek(f, 0, SEEK_END);
-        source.resize(ftell(f));
-        fseek(f, 0, SEEK_SET);
-        fread(&source[0], 1, source.size(), f);
-        fclose(f);
+    printf("multisymbol size: %d bytes\n", (int)coded.size());
+
+    // Decode it
+    double t0 = timer();
+    ByteVec decoded;
+    {
+        BinArithDecoder coder(coded);
+        ByteModel model;
+        for (size_t i = 0; i < source.size(); ++i)
+            decoded.push_back((uint8_t) model.decode(coder));
+    }
+    double t1 = timer();
+
+    // Same thing, batched: one call for the whole buffer, and the coder
+    // state stays in registers throughout.
+    ByteVec coded_batch, decoded_batch(source.size());
+    {
+        BinArithEncoder coder(coded_batch);
+        ByteModel model;
+        encode_block(model, coder, &source[0], source.size());
+    }
+    double t2 = timer();
+    {
+        BinArithDecoder coder(coded_batch);
+        ByteModel model;
+        decode_block(model, coder, &decoded_batch[0], decoded_batch.size());
     }
+    double t3 = timer();
+
+    double mb = source.size() / 1e6;
+    printf("decode: per-symbol %.1f MB/s, batched %.1f MB/s\n", mb / (t1 - t0), mb / (t3 - t2));
+
+    if (decoded != source || coded_batch != coded || decoded_batch != source)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+static void example_interleaved()
+{
+    // Same as the multi-symbol example, but with a 4-way interleaved
+    // coder. The models don't care.
+    typedef BitTreeModel<BinShiftModel<5>, 8> ByteModel;
+    typedef InterleavedBinArithEncoder<4> Encoder;
+    typedef InterleavedBinArithDecoder<4> Decoder;
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
 
     // Encode it
     ByteVec coded;
     {
-        BinArithEncoder coder(coded);
+        Encoder coder(coded);
         ByteModel model;
         for (size_t i = 0; i < source.size(); ++i)
             model.encode(coder, source[i]);
     }
 
-    printf("multisymbol size: %d bytes\n", coded.size());
+    printf("interleaved size: %d bytes\n", (int)coded.size());
 
     // Decode it
     ByteVec decoded;
     {
-        BinArithDecoder coder(coded);
+        Decoder coder(coded);
+        ByteModel model;
+        for (size_t i = 0; i < source.size(); ++i)
+            decoded.push_back((uint8_t) model.decode(coder));
+    }
+
+    if (decoded != source)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+static void example_lanes()
+{
+    // Decoding several independent symbols at once with decode_lanes.
+    // Here it's just the static source from the first example, but it
+    // works for anything where we know the probabilities for the next
+    // N symbols up front, e.g. N independent streams interleaved into
+    // one, one per lane.
+    static int const kLanes = 8;
+    typedef InterleavedBinArithEncoder<kLanes> Encoder;
+    typedef InterleavedBinArithDecoder<kLanes> Decoder;
+    ByteVec source;
+    uint32_t const kProbOne = kProbMax / 5;
+
+    srand(1234);
+    for (size_t i = 0; i < 10000; ++i)
+        source.push_back(rand() < (RAND_MAX/5));
+
+    // Encode it
+    ByteVec coded;
+    {
+        Encoder coder(coded);
+        for (size_t i = 0; i < source.size(); ++i)
+            coder.encode(source[i], kProbOne);
+    }
+
+    printf("lanes size: %d bytes\n", (int)coded.size());
+
+    // Decode it, kLanes symbols at a time
+    ByteVec decoded;
+    {
+        Decoder coder(coded);
+        uint32_t probs[kLanes];
+        int bits[kLanes];
+
+        for (int i = 0; i < kLanes; ++i)
+            probs[i] = kProbOne;
+
+        size_t i = 0;
+        for (; i + kLanes <= source.size(); i += kLanes)
+        {
+            coder.decode_lanes(probs, bits);
+            for (int j = 0; j < kLanes; ++j)
+                decoded.push_back((uint8_t) bits[j]);
+        }
+
+        // Leftovers one at a time
+        for (; i < source.size(); ++i)
+            decoded.push_back((uint8_t) coder.decode(kProbOne));
+    }
+
+    if (decoded != source)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+static void example_blocks()
+{
+    // Block-parallel compression of this source file. Tiny blocks so
+    // there's a few of them.
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    ByteVec coded;
+    compress(coded, &source[0], source.size(), 4096, 0);
+    printf("blocks size: %d bytes\n", (int)coded.size());
+
+    ByteVec decoded, block;
+    bool ok = decompress(decoded, &coded[0], coded.size(), 0);
+    ok = ok && decoded == source;
+
+    // Each backend on its own
+    static BlockBackend const backends[3] = { kBackendArith, kBackendRans, kBackendLz };
+    static char const *const names[3] = { "arith", "rans", "lz" };
+    for (int i = 0; i < 3; ++i)
+    {
+        ByteVec coded_one, decoded_one;
+        compress(coded_one, &source[0], source.size(), 4096, 1, backends[i]);
+        double t0 = timer();
+        ok = decompress(decoded_one, &coded_one[0], coded_one.size(), 1) && ok;
+        double t1 = timer();
+        ok = ok && decoded_one == source;
+        printf("blocks %s: %d bytes, dec %.1f MB/s\n", names[i], (int)coded_one.size(), source.size() / 1e6 / (t1 - t0));
+    }
+
+    // Random access: just the second block
+    ok = ok && decompress_block(block, &coded[0], coded.size(), 1);
+    ok = ok && block.size() == 4096 && memcmp(&block[0], &source[4096], 4096) == 0;
+
+    if (!ok)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+static void append_to_vec(void *user, uint8_t const *data, size_t size)
+{
+    ByteVec *vec = (ByteVec *)user;
+    vec->insert(vec->end(), data, data + size);
+}
+
+// Feed the next chunk of "coded" to "input", or signal the end once
+// it's all gone.
+static void feed_chunk(StreamSource &input, ByteVec const &coded, size_t &fed, size_t chunk_size)
+{
+    if (fed == coded.size())
+    {
+        input.end_input();
+        return;
+    }
+
+    size_t len = coded.size() - fed;
+    if (len > chunk_size)
+        len = chunk_size;
+    fed += input.feed(&coded[fed], len);
+}
+
+// Overwrite a little-endian u32 in place.
+static void poke_le32(ByteVec &buf, size_t pos, uint32_t x)
+{
+    for (int i = 0; i < 4; ++i)
+        buf[pos + i] = (uint8_t)(x >> (i*8));
+}
+
+// Redo the footer CRC of a container after messing with its seek
+// table, so the damage gets past parse().
+static void reseal_container(ByteVec &buf)
+{
+    size_t footer = buf.size() - kContainerFooterSize;
+    size_t table_size = load_le32(&buf[footer + 8]) * kSeekEntrySize;
+    poke_le32(buf, footer + 12, crc32c(&buf[footer - table_size], table_size + 12));
+}
+
+static void example_damaged()
+{
+    // Every way decompressing can fail, on purpose.
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    ByteVec coded, decoded;
+    compress(coded, &source[0], source.size(), 4096, 1);
+    bool ok = try_decompress(decoded, &coded[0], coded.size(), 1) == kDecodeOk && decoded == source;
+
+    // Too short to have a header and footer
+    ok = ok && try_decompress(decoded, &coded[0], 20, 1) == kDecodeTruncated;
+
+    // Cut off mid-stream: the footer isn't where it should be
+    ok = ok && try_decompress(decoded, &coded[0], coded.size() / 2, 1) == kDecodeBadHeader;
+
+    // Not a container
+    ByteVec damaged = coded;
+    damaged[0] ^= 1;
+    ok = ok && try_decompress(decoded, &damaged[0], damaged.size(), 1) == kDecodeBadHeader;
+
+    // A tiny forged container claiming one 4 GB block. This must get
+    // rejected without trying to allocate the block.
+    ByteVec forged;
+    put_le32(forged, kContainerMagic);
+    put_le32(forged, kContainerVersion);
+    put_le32(forged, 0xffffffffu); // block size
+    put_le32(forged, kBlockModelId);
+    forged.resize(forged.size() + 9); // "coded" block
+    put_le32(forged, 9); // seek table: coded size...
+    put_le32(forged, 0); // ...and checksum
+    put_le32(forged, 0xffffffffu); // raw size, low...
+    put_le32(forged, 0); // ...and high half
+    put_le32(forged, 1); // number of blocks
+    put_le32(forged, 0); // CRC, see below
+    put_le32(forged, kContainerMagic);
+    reseal_container(forged);
+    ok = ok && try_decompress(decoded, &forged[0], forged.size(), 1) == kDecodeBadHeader;
+
+    // Bigger than the caller is willing to take
+    ok = ok && try_decompress(decoded, &coded[0], coded.size(), 1, source.size() - 1) == kDecodeTooLarge;
+
+    // First block doesn't decode (unknown backend)
+    damaged = coded;
+    damaged[kContainerHeaderSize] = 0x7f;
+    ok = ok && try_decompress(decoded, &damaged[0], damaged.size(), 1) == kDecodeCorrupt;
+
+    // Last block decodes, but not to what was compressed
+    damaged = coded;
+    size_t last_crc = damaged.size() - kContainerFooterSize - 4;
+    poke_le32(damaged, last_crc, load_le32(&damaged[last_crc]) ^ 1);
+    reseal_container(damaged);
+    ok = ok && try_decompress(decoded, &damaged[0], damaged.size(), 1) == kDecodeBadChecksum;
+
+    // The streaming path finds the same problem, after writing out the
+    // blocks before it.
+    ByteVec streamed;
+    VecSink sink(streamed);
+    ok = ok && try_decompress(sink, &damaged[0], damaged.size(), 1) == kDecodeBadChecksum;
+    ok = ok && streamed.size() < source.size() && memcmp(&streamed[0], &source[0], streamed.size()) == 0;
+
+    if (!ok)
+        printf("error detecting damage!\n");
+    else
+        printf("damage detected ok!\n");
+}
+
+static void example_streaming()
+{
+    // Streaming through small fixed-size buffers. Pretend the output of
+    // the encoder goes off to a file or socket as it's produced, and
+    // the decoder's input trickles in in small chunks.
+    typedef BitTreeModel<BinShiftModel<5>, 8> ByteModel;
+    static size_t const kChunkSize = 100;
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    // Encode it
+    ByteVec coded;
+    {
+        StreamSink sink(append_to_vec, &coded, 256);
+        BinArithEncoder coder(sink);
+        ByteModel model;
+        for (size_t i = 0; i < source.size(); ++i)
+            model.encode(coder, source[i]);
+        coder.finish();
+    }
+
+    printf("streaming size: %d bytes\n", (int)coded.size());
+
+    // Decode it
+    ByteVec decoded;
+    {
+        StreamSource input(512);
+        size_t fed = 0;
+
+        while (!input.can_read(4))
+            feed_chunk(input, coded, fed, kChunkSize);
+
+        BinArithDecoder coder(input);
         ByteModel model;
         for (size_t i = 0; i < source.size(); ++i)
+        {
+            // A byte is 8 binary symbols
+            while (!input.can_read(8 * kMaxBytesPerSymbol))
+                feed_chunk(input, coded, fed, kChunkSize);
+
             decoded.push_back((uint8_t) model.decode(coder));
+        }
+
+        if (coder.overrun())
+            decoded.clear();
     }
 
     if (decoded != source)
@@ -344,11 +661,1708 @@ static void example_multisymbol()
         printf("decodes ok!\n");
 }
 
-int main()
+static void example_resumable()
+{
+    // Resumable decoding: input arrives in odd-sized chunks, and halfway
+    // through we "move" the decoder elsewhere by copying its state, the
+    // way you'd hand it to a different thread when the next network read
+    // completes.
+    typedef BitTreeModel<BinShiftModel<5>, 8> ByteModel;
+    typedef ResumableByteDecoder<ByteModel> Decoder;
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    // Encode it
+    ByteVec coded;
+    {
+        BinArithEncoder coder(coded);
+        ByteModel model;
+        for (size_t i = 0; i < source.size(); ++i)
+            model.encode(coder, source[i]);
+    }
+
+    // Decode it
+    ByteVec decoded(source.size());
+    {
+        Decoder first, second;
+        Decoder *dec = &first;
+        dec->start(decoded.size());
+
+        size_t fed = 0;
+        size_t chunk = 1;
+        while (!dec->done() && fed < coded.size())
+        {
+            size_t len = coded.size() - fed;
+            if (len > chunk)
+                len = chunk;
+
+            fed += dec->resume(&coded[fed], len, fed + len == coded.size(), &decoded[0]);
+            chunk = chunk * 3 + 1;
+
+            // Move it once we're past the halfway point.
+            if (dec == &first && fed >= coded.size() / 2)
+            {
+                memcpy(&second, &first, sizeof(first));
+                dec = &second;
+            }
+        }
+
+        if (!dec->done() || dec->overrun)
+            decoded.clear();
+    }
+
+    if (decoded != source)
+        printf("error decoding!\n");
+    else
+        printf("resumable decodes ok!\n");
+}
+
+// Order-1 byte coder: one bit tree per previous byte.
+template<typename Tree>
+static bool order1_roundtrip(ByteVec const &source, ByteVec &coded)
 {
+    std::vector<Tree> models(256);
+
+    coded.clear();
+    {
+        BinArithEncoder coder(coded);
+        uint8_t prev = 0;
+        for (size_t i = 0; i < source.size(); ++i)
+        {
+            models[prev].encode(coder, source[i]);
+            prev = source[i];
+        }
+    }
+
+    models.assign(256, Tree());
+    BinArithDecoder coder(coded);
+    uint8_t prev = 0;
+    for (size_t i = 0; i < source.size(); ++i)
+    {
+        prev = (uint8_t) models[prev].decode(coder);
+        if (prev != source[i])
+            return false;
+    }
+
+    return true;
+}
+
+static void example_order1()
+{
+    // Order-1 context models with the different tree layouts. The
+    // blocked one produces the same bitstream as the flat one; the
+    // packed probabilities make it different (and the tables half
+    // the size).
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    ByteVec flat, blocked, packed;
+    bool ok = order1_roundtrip<BitTreeModel<BinShiftModel<4>, 8> >(source, flat);
+    ok = order1_roundtrip<BlockedBitTreeModel<BinShiftModel<4>, 8> >(source, blocked) && ok;
+    ok = order1_roundtrip<BlockedBitTreeModel<PackedBinShiftModel<4>, 8> >(source, packed) && ok;
+    ok = ok && flat == blocked;
+
+    printf("order1 size: flat %d bytes, blocked %d bytes, packed %d bytes\n",
+        (int)flat.size(), (int)blocked.size(), (int)packed.size());
+
+    if (!ok)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+static void example_context_mix()
+{
+    // Context mixing vs. the plain order-0 bit tree, on this source file.
+    // Better ratio, but a lot slower, so print throughput too.
+    typedef BitTreeModel<BinShiftModel<5>, 8> ByteModel;
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    double mb = source.size() / 1e6;
+    double t0, t1, t2;
+
+    // Order-0 baseline
+    ByteVec coded0, decoded0(source.size());
+    t0 = timer();
+    {
+        BinArithEncoder coder(coded0);
+        ByteModel model;
+        for (size_t i = 0; i < source.size(); ++i)
+            model.encode(coder, source[i]);
+    }
+    t1 = timer();
+    {
+        BinArithDecoder coder(coded0);
+        ByteModel model;
+        for (size_t i = 0; i < source.size(); ++i)
+            decoded0[i] = (uint8_t) model.decode(coder);
+    }
+    t2 = timer();
+    printf("order0 size: %d bytes, enc %.1f MB/s, dec %.1f MB/s\n", (int)coded0.size(), mb / (t1 - t0), mb / (t2 - t1));
+
+    // Context mixing
+    ByteVec coded, decoded(source.size());
+    t0 = timer();
+    {
+        BinArithEncoder coder(coded);
+        ContextMixModel model;
+        for (size_t i = 0; i < source.size(); ++i)
+            model.encode(coder, source[i]);
+    }
+    t1 = timer();
+    {
+        BinArithDecoder coder(coded);
+        ContextMixModel model;
+        for (size_t i = 0; i < source.size(); ++i)
+            decoded[i] = model.decode(coder);
+    }
+    t2 = timer();
+    printf("context mix size: %d bytes, enc %.1f MB/s, dec %.1f MB/s\n", (int)coded.size(), mb / (t1 - t0), mb / (t2 - t1));
+
+    if (decoded != source || decoded0 != source)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+// Code "source" in independent blocks of "block_size" bytes, each with
+// fresh models; returns the total size.
+template<typename Tree>
+static size_t short_blocks_size(ByteVec const &source, size_t block_size, bool *ok)
+{
+    size_t total = 0;
+
+    for (size_t start = 0; start < source.size(); start += block_size)
+    {
+        size_t len = source.size() - start < block_size ? source.size() - start : block_size;
+
+        ByteVec coded;
+        {
+            BinArithEncoder coder(coded);
+            Tree model;
+            for (size_t i = 0; i < len; ++i)
+                model.encode(coder, source[start + i]);
+        }
+        total += coded.size();
+
+        BinArithDecoder coder(coded);
+        Tree model;
+        for (size_t i = 0; i < len; ++i)
+            if (model.decode(coder) != source[start + i])
+                *ok = false;
+    }
+
+    return total;
+}
+
+static void example_warmup()
+{
+    // Lots of short blocks with fresh models, where warm-up is everything.
+    static size_t const kBlockSize = 256;
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    bool ok = true;
+    printf("short blocks: shift4 %d, shift5 %d, two-rate %d, var-rate %d, state %d bytes\n",
+        (int)short_blocks_size<BitTreeModel<BinShiftModel<4>, 8> >(source, kBlockSize, &ok),
+        (int)short_blocks_size<BitTreeModel<BinShiftModel<5>, 8> >(source, kBlockSize, &ok),
+        (int)short_blocks_size<BitTreeModel<BinTwoRateModel<2, 5>, 8> >(source, kBlockSize, &ok),
+        (int)short_blocks_size<BitTreeModel<BinVarRateModel<5>, 8> >(source, kBlockSize, &ok),
+        (int)short_blocks_size<BitTreeModel<BinStateModel, 8> >(source, kBlockSize, &ok));
+
+    if (!ok)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+static void example_bypass()
+{
+    // Near-incompressible payload: 12 raw bits per value (think low
+    // mantissa bits), coded once as bypass bits and once through
+    // encode() with a probability that the compiler can't see is 1/2.
+    static int const kCount = 1000000;
+    static int const kBits = 12;
+    std::vector<uint16_t> values(kCount);
+    uint32_t seed = 1234;
+    for (int i = 0; i < kCount; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        values[i] = (uint16_t) (seed >> 20);
+    }
+
+    volatile uint32_t half = kProbMax / 2;
+    uint32_t prob = half;
+    double mb = kCount * kBits / 8e6;
+
+    ByteVec coded_bypass, coded_prob;
+    double t0 = timer();
+    {
+        BinArithEncoder coder(coded_bypass);
+        for (int i = 0; i < kCount; ++i)
+            coder.encode_bits(values[i], kBits);
+    }
+    double t1 = timer();
+    {
+        BinArithEncoder coder(coded_prob);
+        for (int i = 0; i < kCount; ++i)
+            for (int j = kBits - 1; j >= 0; --j)
+                coder.encode((values[i] >> j) & 1, prob);
+    }
+    double t2 = timer();
+
+    bool ok = coded_bypass == coded_prob;
+    {
+        BinArithDecoder coder(coded_bypass);
+        for (int i = 0; i < kCount; ++i)
+            if (coder.decode_bits(kBits) != values[i])
+                ok = false;
+    }
+    double t3 = timer();
+
+    printf("bypass size: %d bytes (raw %d)\n", (int)coded_bypass.size(), kCount * kBits / 8);
+    printf("encode_bits %.1f MB/s, encode %.1f MB/s, decode_bits %.1f MB/s\n",
+        mb / (t1 - t0), mb / (t2 - t1), mb / (t3 - t2));
+
+    // The 64-bit coder takes all 12 bits as one symbol, so it's not
+    // the same bitstream as bit-by-bit bypass there; check it against
+    // its own decoder instead, with a modeled bit between values so
+    // the two kinds of symbol get mixed.
+    ByteVec coded64;
+    t0 = timer();
+    {
+        BinArithEncoder64 coder(coded64);
+        for (int i = 0; i < kCount; ++i)
+        {
+            coder.encode_bits(values[i], kBits);
+            coder.encode(values[i] & 1, prob);
+        }
+    }
+    t1 = timer();
+    {
+        BinArithDecoder64 coder(coded64);
+        for (int i = 0; i < kCount; ++i)
+        {
+            if (coder.decode_bits(kBits) != values[i])
+                ok = false;
+            if (coder.decode(prob) != (values[i] & 1))
+                ok = false;
+        }
+    }
+    t2 = timer();
+
+    printf("64-bit: %d bytes, encode_bits %.1f MB/s, decode_bits %.1f MB/s\n",
+        (int)coded64.size(), mb / (t1 - t0), mb / (t2 - t1));
+
+    if (!ok)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+// Code "source" with the bit tree and with the range coder; returns
+// false on mismatch.
+static bool range_vs_bittree(char const *name, ByteVec const &source)
+{
+    typedef BitTreeModel<BinShiftModel<5>, 8> ByteModel;
+    double mb = source.size() / 1e6;
+
+    ByteVec coded_bits, decoded_bits(source.size());
+    {
+        BinArithEncoder coder(coded_bits);
+        ByteModel model;
+        encode_block(model, coder, &source[0], source.size());
+    }
+    double t0 = timer();
+    {
+        BinArithDecoder coder(coded_bits);
+        ByteModel model;
+        decode_block(model, coder, &decoded_bits[0], decoded_bits.size());
+    }
+    double t1 = timer();
+
+    ByteVec coded_range, decoded_range(source.size());
+    {
+        RangeEncoder coder(coded_range);
+        FreqTableModel<256> model;
+        for (size_t i = 0; i < source.size(); ++i)
+            model.encode(coder, source[i]);
+    }
+    double t2 = timer();
+    {
+        RangeDecoder coder(coded_range);
+        FreqTableModel<256> model;
+        for (size_t i = 0; i < source.size(); ++i)
+            decoded_range[i] = (uint8_t) model.decode(coder);
+    }
+    double t3 = timer();
+
+    printf("%s: bit tree %d bytes, dec %.1f MB/s; range %d bytes, dec %.1f MB/s\n", name,
+        (int)coded_bits.size(), mb / (t1 - t0), (int)coded_range.size(), mb / (t3 - t2));
+
+    return decoded_bits == source && decoded_range == source;
+}
+
+// A low-entropy stream: mostly zeros, some small values.
+static void make_skewed(ByteVec &out, size_t size)
+{
+    out.resize(size);
+    uint32_t seed = 5678;
+    for (size_t i = 0; i < size; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        uint32_t r = seed >> 24;
+        out[i] = (uint8_t) (r < 224 ? 0 : r & 15);
+    }
+}
+
+static void example_range()
+{
+    // Multi-symbol range coder vs. the binary bit tree, on this source
+    // file and on a skewed stream.
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    ByteVec skewed;
+    make_skewed(skewed, 1000000);
+
+    bool ok = range_vs_bittree("text", source);
+    ok = range_vs_bittree("skewed", skewed) && ok;
+
+    if (!ok)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+static void example_small_messages()
+{
+    // Lots of tiny messages (16-byte pieces of this source file), coded
+    // independently. First the obvious way, with everything constructed
+    // fresh per message, then reusing a CodingContext.
+    typedef BitTreeModel<BinShiftModel<4>, 8> ByteModel;
+    static size_t const kMessageSize = 16;
+    static int const kPasses = 20;
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    size_t num_messages = source.size() / kMessageSize;
+    size_t fresh_size = 0, context_size = 0;
+    bool ok = true;
+
+    double t0 = timer();
+    for (int pass = 0; pass < kPasses; ++pass)
+    {
+        for (size_t m = 0; m < num_messages; ++m)
+        {
+            ByteVec coded;
+            {
+                BinArithEncoder coder(coded);
+                ByteModel model;
+                encode_block(model, coder, &source[m * kMessageSize], kMessageSize);
+            }
+            fresh_size += coded.size();
+        }
+    }
+
+    double t1 = timer();
+    CodingContext<ByteModel> ctx;
+    for (int pass = 0; pass < kPasses; ++pass)
+    {
+        for (size_t m = 0; m < num_messages; ++m)
+        {
+            ctx.reset();
+            {
+                BinArithEncoder coder(ctx.sink());
+                encode_block(ctx.model(), coder, &source[m * kMessageSize], kMessageSize);
+            }
+            context_size += ctx.size();
+        }
+    }
+    double t2 = timer();
+
+    // Decode the last message with the context's model (reset again).
+    uint8_t decoded[kMessageSize];
+    ByteVec last(ctx.data(), ctx.data() + ctx.size());
+    ctx.reset();
+    {
+        BinArithDecoder coder(last);
+        decode_block(ctx.model(), coder, decoded, kMessageSize);
+    }
+    ok = ok && fresh_size == context_size;
+    ok = ok && memcmp(decoded, &source[(num_messages - 1) * kMessageSize], kMessageSize) == 0;
+
+    double msgs = (double)num_messages * kPasses;
+    printf("small messages: fresh %.2f M msgs/s, context %.2f M msgs/s\n",
+        msgs / 1e6 / (t1 - t0), msgs / 1e6 / (t2 - t1));
+
+    if (!ok)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+// Some made-up JSON log lines: lots of repeated structure, a few
+// fields that change.
+static void make_json_log(ByteVec &out, int lines)
+{
+    static char const *const levels[] = { "info", "info", "info", "warn", "error" };
+    static char const *const paths[] = { "/api/users", "/api/orders", "/static/app.js", "/health" };
+    uint32_t seed = 777;
+    char buf[256];
+    for (int i = 0; i < lines; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        int len = snprintf(buf, sizeof(buf),
+            "{\"ts\":%d,\"level\":\"%s\",\"path\":\"%s\",\"status\":%d,\"ms\":%u,\"user\":%u}\n",
+            1700000000 + i * 3, levels[(seed >> 8) % 5], paths[(seed >> 12) % 4],
+            (seed >> 16) % 7 ? 200 : 404, (seed >> 20) % 500, (seed >> 4) % 1000);
+        out.insert(out.end(), buf, buf + len);
+    }
+}
+
+static bool lz_roundtrip(char const *name, ByteVec const &source)
+{
+    ByteVec order0, coded, coded_threaded, decoded(source.size());
+    arith_encode(order0, &source[0], source.size());
+
+    LzOptions opts;
+    double t0 = timer();
+    lz_encode(coded, &source[0], source.size(), opts);
+    double t1 = timer();
+    opts.threaded = true;
+    lz_encode(coded_threaded, &source[0], source.size(), opts);
+    double t2 = timer();
+    bool ok = lz_decode(&decoded[0], decoded.size(), &coded[0], coded.size());
+    double t3 = timer();
+
+    double mb = source.size() / 1e6;
+    printf("%s: %d bytes, order-0 %d, lz %d; enc %.1f MB/s (threaded %.1f), dec %.1f MB/s\n", name,
+        (int)source.size(), (int)order0.size(), (int)coded.size(), mb / (t1 - t0), mb / (t2 - t1), mb / (t3 - t2));
+
+    return ok && decoded == source && coded_threaded == coded;
+}
+
+static void example_lz()
+{
+    ByteVec source, log;
+    if (!read_file("main.cpp", source))
+        return;
+    make_json_log(log, 20000);
+
+    bool ok = lz_roundtrip("lz source", source);
+    ok = lz_roundtrip("lz json log", log) && ok;
+
+    // Truncated input must fail, not crash.
+    ByteVec coded, decoded(log.size());
+    lz_encode(coded, &log[0], log.size());
+    ok = ok && !lz_decode(&decoded[0], decoded.size(), &coded[0], coded.size() / 2);
+
+    if (!ok)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+// Records for example_multistream: three fields, each with its own
+// model that only looks at its own field.
+struct MsRecordModels
+{
+    BitTreeModel<BinShiftModel<4>, 2> kind;
+    BitTreeModel<BinShiftModel<5>, 8> value[4]; // by top 2 bits of the previous value
+    BitTreeModel<BinShiftModel<5>, 8> delta;
+};
+
+static void ms_decode_field(BinArithDecoder *coder, std::vector<uint8_t> *out, int field)
+{
+    MsRecordModels models;
+    BinArithDecoderBatch dec(*coder);
+    uint8_t prev = 0;
+    for (size_t i = 0; i < out->size(); ++i)
+    {
+        if (field == 0)
+            (*out)[i] = (uint8_t) models.kind.decode(dec);
+        else if (field == 1)
+            prev = (*out)[i] = (uint8_t) models.value[prev >> 6].decode(dec);
+        else
+            (*out)[i] = (uint8_t) models.delta.decode(dec);
+    }
+}
+
+static void example_multistream()
+{
+    // Made-up telemetry records: a skewed 2-bit kind, a slowly
+    // wandering value and a small time delta.
+    static int const kCount = 1000000;
+    std::vector<uint8_t> fields[3];
+    for (int f = 0; f < 3; ++f)
+        fields[f].resize(kCount);
+
+    uint32_t seed = 99;
+    int value = 128;
+    for (int i = 0; i < kCount; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        fields[0][i] = (seed >> 28) < 11 ? 0 : (uint8_t)((seed >> 24) & 3);
+        value = (value + (int)((seed >> 16) & 7) - 3) & 255;
+        fields[1][i] = (uint8_t)value;
+        fields[2][i] = (uint8_t)(10 + ((seed >> 8) & 3) * ((seed >> 12) & 3));
+    }
+
+    // All in one stream vs. one stream per field; same models.
+    ByteVec single, multi;
+    {
+        BinArithEncoder coder(single);
+        MsRecordModels models;
+        for (int i = 0; i < kCount; ++i)
+        {
+            models.kind.encode(coder, fields[0][i]);
+            models.value[i ? fields[1][i - 1] >> 6 : 0].encode(coder, fields[1][i]);
+            models.delta.encode(coder, fields[2][i]);
+        }
+    }
+    {
+        MultiStreamEncoder<3> enc;
+        MsRecordModels models;
+        for (int i = 0; i < kCount; ++i)
+        {
+            models.kind.encode(enc.stream(0), fields[0][i]);
+            models.value[i ? fields[1][i - 1] >> 6 : 0].encode(enc.stream(1), fields[1][i]);
+            models.delta.encode(enc.stream(2), fields[2][i]);
+        }
+        enc.finish(multi);
+    }
+
+    bool ok = true;
+    std::vector<uint8_t> out[3];
+    for (int f = 0; f < 3; ++f)
+        out[f].resize(kCount);
+
+    // Single stream, serial.
+    double t0 = timer();
+    {
+        BinArithDecoder coder(single);
+        MsRecordModels models;
+        BinArithDecoderBatch dec(coder);
+        uint8_t prev = 0;
+        for (int i = 0; i < kCount; ++i)
+        {
+            out[0][i] = (uint8_t) models.kind.decode(dec);
+            prev = out[1][i] = (uint8_t) models.value[prev >> 6].decode(dec);
+            out[2][i] = (uint8_t) models.delta.decode(dec);
+        }
+    }
+    double t1 = timer();
+    for (int f = 0; f < 3; ++f)
+        ok = ok && out[f] == fields[f];
+
+    // Multi-stream, interleaved in one loop: three independent chains,
+    // but also three coder states competing for registers. This one
+    // comes out slower than serial (see MultiStreamEncoder); it's here
+    // to keep checking that.
+    {
+        MultiStreamDecoder<3> dec(&multi[0], multi.size());
+        MsRecordModels models;
+        BinArithDecoderBatch dec0(dec.stream(0)), dec1(dec.stream(1)), dec2(dec.stream(2));
+        uint8_t prev = 0;
+        for (int i = 0; i < kCount; ++i)
+        {
+            out[0][i] = (uint8_t) models.kind.decode(dec0);
+            prev = out[1][i] = (uint8_t) models.value[prev >> 6].decode(dec1);
+            out[2][i] = (uint8_t) models.delta.decode(dec2);
+        }
+        ok = ok && dec.ok();
+    }
+    double t2 = timer();
+    for (int f = 0; f < 3; ++f)
+        ok = ok && out[f] == fields[f];
+
+    // Multi-stream, one thread per stream. This is where multiple
+    // streams pay off, given the cores.
+    for (int f = 0; f < 3; ++f)
+        std::fill(out[f].begin(), out[f].end(), 0);
+    double t3 = timer();
+    {
+        MultiStreamDecoder<3> dec(&multi[0], multi.size());
+        std::thread threads[3];
+        for (int f = 0; f < 3; ++f)
+            threads[f] = std::thread(ms_decode_field, &dec.stream(f), &out[f], f);
+        for (int f = 0; f < 3; ++f)
+            threads[f].join();
+        ok = ok && !dec.overrun();
+    }
+    double t4 = timer();
+    for (int f = 0; f < 3; ++f)
+        ok = ok && out[f] == fields[f];
+
+    // A truncated bundle has to be rejected.
+    {
+        MultiStreamDecoder<3> dec(&multi[0], multi.size() - 1);
+        ok = ok && !dec.ok();
+    }
+
+    double mrec = kCount / 1e6;
+    printf("multi-stream: single %d bytes, 3 streams %d bytes\n", (int)single.size(), (int)multi.size());
+    printf("decode: serial %.1f Mrec/s, interleaved %.1f Mrec/s, threaded %.1f Mrec/s\n",
+        mrec / (t1 - t0), mrec / (t2 - t1), mrec / (t4 - t3));
+
+    if (!ok)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+// Size of "data" coded with a fresh BinShiftModel<Inertia> bit tree.
+template<int Inertia>
+static size_t shift_tree_size(uint8_t const *data, size_t size)
+{
+    ByteVec out;
+    {
+        BinArithEncoder coder(out);
+        BitTreeModel<BinShiftModel<Inertia>, 8> model;
+        encode_block(model, coder, data, size);
+    }
+    return out.size();
+}
+
+// Cost in bits of "data" by running a fresh BinShiftModel<Inertia> bit
+// tree against a CostEstimator.
+template<int Inertia>
+static double shift_tree_cost(uint8_t const *data, size_t size)
+{
+    CostEstimator est;
+    BitTreeModel<BinShiftModel<Inertia>, 8> model;
+    for (size_t i = 0; i < size; ++i)
+        model.encode(est, data[i]);
+    return est.bits();
+}
+
+// The AVX2 shift cost kernel has to give exactly what the scalar one
+// does. Checked on its own (not through estimate_shift_costs, which
+// only ever runs one of them), with all lanes in use. Trivially true
+// without AVX2.
+static bool shift_kernels_agree(uint8_t const *data, size_t size)
+{
+#ifdef MINI_ARITH_X86
+    if (!(cpu_features() & kCpuAVX2))
+        return true;
+
+    static uint32_t const kShifts[kMaxCostCandidates] = { 1, 2, 3, 5, 7, 9, 10, 11 };
+    uint64_t scalar[kMaxCostCandidates] = { 0 }, avx2[kMaxCostCandidates] = { 0 };
+    shift_cost_scalar(data, size, kShifts, scalar);
+    shift_cost_avx2(data, size, kShifts, avx2);
+    return memcmp(scalar, avx2, sizeof(scalar)) == 0;
+#else
+    (void)data;
+    (void)size;
+    return true;
+#endif
+}
+
+static void example_cost()
+{
+    // Per-block choice of Inertia: by estimating all candidates in one
+    // pass vs. by encoding the block with each one.
+    static size_t const kBlockSize = 16384;
+    static int const kInertias[] = { 2, 3, 4, 5, 6, 7, 8 };
+    static int const kCount = (int)(sizeof(kInertias) / sizeof(*kInertias));
+    typedef size_t SizeFunc(uint8_t const *data, size_t size);
+    static SizeFunc *const kSizeFuncs[kCount] =
+    {
+        shift_tree_size<2>, shift_tree_size<3>, shift_tree_size<4>, shift_tree_size<5>,
+        shift_tree_size<6>, shift_tree_size<7>, shift_tree_size<8>,
+    };
+    typedef double CostFunc(uint8_t const *data, size_t size);
+    static CostFunc *const kCostFuncs[kCount] =
+    {
+        shift_tree_cost<2>, shift_tree_cost<3>, shift_tree_cost<4>, shift_tree_cost<5>,
+        shift_tree_cost<6>, shift_tree_cost<7>, shift_tree_cost<8>,
+    };
+
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+    size_t num_blocks = (source.size() + kBlockSize - 1) / kBlockSize;
+
+    std::vector<int> picked(num_blocks);
+    double est_bytes = 0.0;
+    double t0 = timer();
+    for (size_t b = 0; b < num_blocks; ++b)
+    {
+        size_t start = b * kBlockSize;
+        size_t size = source.size() - start < kBlockSize ? source.size() - start : kBlockSize;
+        double bits[kCount];
+        estimate_shift_costs(&source[start], size, kInertias, kCount, bits);
+
+        int best = 0;
+        for (int k = 1; k < kCount; ++k)
+            if (bits[k] < bits[best])
+                best = k;
+        picked[b] = best;
+        est_bytes += bits[best] / 8.0;
+    }
+    double t1 = timer();
+
+    size_t same = 0, picked_bytes = 0, best_bytes = 0;
+    for (size_t b = 0; b < num_blocks; ++b)
+    {
+        size_t start = b * kBlockSize;
+        size_t size = source.size() - start < kBlockSize ? source.size() - start : kBlockSize;
+        size_t sizes[kCount];
+        int best = 0;
+        for (int k = 0; k < kCount; ++k)
+        {
+            sizes[k] = kSizeFuncs[k](&source[start], size);
+            if (sizes[k] < sizes[best])
+                best = k;
+        }
+        same += picked[b] == best;
+        picked_bytes += sizes[picked[b]];
+        best_bytes += sizes[best];
+    }
+    double t2 = timer();
+
+    // The one-pass estimate has to agree with running the real model
+    // against a CostEstimator, for every candidate, on a block and on
+    // the whole file (which crosses the kernels' flush interval).
+    bool ok = true;
+    size_t sizes[2] = { source.size() < kBlockSize ? source.size() : kBlockSize, source.size() };
+    for (int s = 0; s < 2; ++s)
+    {
+        double bits[kCount];
+        estimate_shift_costs(&source[0], sizes[s], kInertias, kCount, bits);
+        for (int k = 0; k < kCount; ++k)
+            ok = ok && bits[k] == kCostFuncs[k](&source[0], sizes[s]);
+    }
+    ok = shift_kernels_agree(&source[0], source.size()) && ok;
+
+    printf("cost estimate: %d/%d blocks picked the same Inertia, estimated %.0f bytes, actual %d (best %d)\n",
+        (int)same, (int)num_blocks, est_bytes, (int)picked_bytes, (int)best_bytes);
+    printf("estimating %d candidates took %.2f ms, encoding them %.2f ms\n", kCount, (t1 - t0) * 1e3, (t2 - t1) * 1e3);
+
+    if (!ok)
+        printf("error estimating!\n");
+    else
+        printf("estimates ok!\n");
+}
+
+// Code "source" through a byte-wise bit tree with the coder picked by
+// state width; returns decode time in seconds, or -1 on mismatch.
+template<typename Word>
+static double wide_roundtrip(ByteVec const &source, size_t *coded_size)
+{
+    typedef typename BinArithCoder<Word>::Encoder Encoder;
+    typedef typename BinArithCoder<Word>::Decoder Decoder;
+    typedef BitTreeModel<BinShiftModel<5>, 8> ByteModel;
+
+    ByteVec coded, decoded(source.size());
+    {
+        Encoder coder(coded);
+        ByteModel model;
+        for (size_t i = 0; i < source.size(); ++i)
+            model.encode(coder, source[i]);
+    }
+    double t0 = timer();
+    {
+        Decoder coder(coded);
+        ByteModel model;
+        for (size_t i = 0; i < decoded.size(); ++i)
+            decoded[i] = (uint8_t) model.decode(coder);
+    }
+    double t1 = timer();
+
+    *coded_size = coded.size();
+    return decoded == source ? t1 - t0 : -1.0;
+}
+
+static void example_wide()
+{
+    // 32-bit vs. 64-bit state on this source file, plus a very skewed
+    // static source sitting right at the smallest probability we have.
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    size_t size32, size64;
+    double t32 = wide_roundtrip<uint32_t>(source, &size32);
+    double t64 = wide_roundtrip<uint64_t>(source, &size64);
+    bool ok = t32 >= 0.0 && t64 >= 0.0;
+    double mb = source.size() / 1e6;
+    printf("state width: 32-bit %d bytes, dec %.1f MB/s; 64-bit %d bytes, dec %.1f MB/s\n",
+        (int)size32, mb / t32, (int)size64, mb / t64);
+
+    static int const kCount = 4000000;
+    uint32_t const kProbOne = 1;
+    ByteVec bits(kCount);
+    uint32_t seed = 4321;
+    for (int i = 0; i < kCount; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        bits[i] = (seed >> (32 - kProbBits)) < kProbOne;
+    }
+
+    ByteVec coded32, coded64;
+    {
+        BinArithEncoder coder32(coded32);
+        BinArithEncoder64 coder64(coded64);
+        for (int i = 0; i < kCount; ++i)
+        {
+            coder32.encode(bits[i], kProbOne);
+            coder64.encode(bits[i], kProbOne);
+        }
+    }
+    {
+        BinArithDecoder coder32(coded32);
+        BinArithDecoder64 coder64(coded64);
+        for (int i = 0; i < kCount; ++i)
+            if (coder32.decode(kProbOne) != bits[i] || coder64.decode(kProbOne) != bits[i])
+                ok = false;
+    }
+
+    double p = kProbOne / (double)kProbMax;
+    double entropy = kCount * (-p * log_2(p) - (1.0 - p) * log_2(1.0 - p)) / 8.0;
+    printf("skewed: 32-bit %d bytes, 64-bit %d bytes - entropy: %.2f bytes\n",
+        (int)coded32.size(), (int)coded64.size(), entropy);
+
+    if (!ok)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+static void example_dictionary()
+{
+    // Train a model on the first half of this file, then code 64-byte
+    // messages from the second half, each from scratch vs. starting
+    // from the trained snapshot.
+    typedef BitTreeModel<BinShiftModel<5>, 8> ByteModel;
+    static uint32_t const kModelId = 0x42540805; // "BT", 8 bits, shift 5
+    static size_t const kMessageSize = 64;
+    ByteVec source;
+    if (!read_file("main.cpp", source))
+        return;
+
+    size_t half = source.size() / 2;
+    ByteVec snapshot;
+    {
+        ByteModel *model = new ByteModel;
+        train_model(*model, &source[0], half);
+        save_snapshot(snapshot, *model, kModelId);
+        delete model;
+    }
+
+    CodingContext<ByteModel> fresh, primed;
+    bool ok = restore_snapshot(primed.initial_model(), &snapshot[0], snapshot.size(), kModelId);
+
+    size_t fresh_size = 0, primed_size = 0;
+    for (size_t pos = half; pos + kMessageSize <= source.size(); pos += kMessageSize)
+    {
+        fresh.reset();
+        primed.reset();
+        {
+            BinArithEncoder coder(fresh.sink());
+            encode_block(fresh.model(), coder, &source[pos], kMessageSize);
+        }
+        {
+            BinArithEncoder coder(primed.sink());
+            encode_block(primed.model(), coder, &source[pos], kMessageSize);
+        }
+        fresh_size += fresh.size();
+        primed_size += primed.size();
+
+        // Decoder restores the same snapshot.
+        uint8_t decoded[kMessageSize];
+        ByteVec coded(primed.data(), primed.data() + primed.size());
+        primed.reset();
+        BinArithDecoder coder(coded);
+        decode_block(primed.model(), coder, decoded, kMessageSize);
+        ok = ok && memcmp(decoded, &source[pos], kMessageSize) == 0;
+    }
+
+    printf("dictionary: snapshot %d bytes, messages fresh %d bytes, primed %d bytes\n",
+        (int)snapshot.size(), (int)fresh_size, (int)primed_size);
+
+    if (!ok)
+        printf("error decoding!\n");
+    else
+        printf("decodes ok!\n");
+}
+
+// ---- Benchmark suite
+
+// Runs every coder/model combination over a set of sources, and
+// reports size (vs. order-0 entropy), encode/decode throughput (mean
+// and standard deviation over the runs) and decode cycles per source
+// bit. Binary sources have one bit per byte and only go through the
+// binary models; byte sources go through everything else.
+
+typedef void BenchEncodeFunc(ByteVec &out, uint8_t const *data, size_t size);
+typedef bool BenchDecodeFunc(uint8_t *out, size_t size, uint8_t const *coded, size_t coded_size);
+
+struct BenchCodec
+{
+    char const *name;
+    bool bits; // binary source?
+    BenchEncodeFunc *encode;
+    BenchDecodeFunc *decode;
+};
+
+struct BenchSource
+{
+    char const *name;
+    bool bits;
+    ByteVec data;
+};
+
+// Time stamp counter, where there is one. That counts at a fixed rate
+// on current x86s, not actual core clocks, so turbo skews it a bit.
+static bool have_cycle_counter()
+{
+#ifdef MINI_ARITH_X86
+    return true;
+#else
+    return false;
+#endif
+}
+
+static uint64_t read_cycles()
+{
+#ifdef MINI_ARITH_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Expected size in bytes of "data" at its order-0 entropy.
+static double order0_entropy_bytes(uint8_t const *data, size_t size)
+{
+    size_t hist[256] = { 0 };
+    for (size_t i = 0; i < size; ++i)
+        hist[data[i]]++;
+
+    double bits = 0.0;
+    for (int i = 0; i < 256; ++i)
+        if (hist[i])
+            bits -= hist[i] * log_2((double)hist[i] / (double)size);
+    return bits / 8.0;
+}
+
+template<typename BitModel, typename Encoder>
+static void bench_bits_encode(ByteVec &out, uint8_t const *data, size_t size)
+{
+    Encoder coder(out);
+    BitModel model;
+    for (size_t i = 0; i < size; ++i)
+        model.encode(coder, data[i]);
+}
+
+template<typename BitModel, typename Decoder>
+static bool bench_bits_decode(uint8_t *out, size_t size, uint8_t const *coded, size_t coded_size)
+{
+    Decoder coder(coded, coded_size);
+    BitModel model;
+    for (size_t i = 0; i < size; ++i)
+        out[i] = (uint8_t) model.decode(coder);
+    return !coder.overrun();
+}
+
+template<typename Tree, typename Encoder>
+static void bench_tree_encode(ByteVec &out, uint8_t const *data, size_t size)
+{
+    Encoder coder(out);
+    Tree model;
+    for (size_t i = 0; i < size; ++i)
+        model.encode(coder, data[i]);
+}
+
+template<typename Tree, typename Decoder>
+static bool bench_tree_decode(uint8_t *out, size_t size, uint8_t const *coded, size_t coded_size)
+{
+    Decoder coder(coded, coded_size);
+    Tree model;
+    for (size_t i = 0; i < size; ++i)
+        out[i] = (uint8_t) model.decode(coder);
+    return !coder.overrun();
+}
+
+template<typename Tree>
+static void bench_batch_encode(ByteVec &out, uint8_t const *data, size_t size)
+{
+    BinArithEncoder coder(out);
+    Tree model;
+    encode_block(model, coder, data, size);
+}
+
+template<typename Tree>
+static bool bench_batch_decode(uint8_t *out, size_t size, uint8_t const *coded, size_t coded_size)
+{
+    BinArithDecoder coder(coded, coded_size);
+    Tree model;
+    decode_block(model, coder, out, size);
+    return !coder.overrun();
+}
+
+static void bench_range_encode(ByteVec &out, uint8_t const *data, size_t size)
+{
+    RangeEncoder coder(out);
+    FreqTableModel<256> model;
+    for (size_t i = 0; i < size; ++i)
+        model.encode(coder, data[i]);
+}
+
+static bool bench_range_decode(uint8_t *out, size_t size, uint8_t const *coded, size_t coded_size)
+{
+    RangeDecoder coder(coded, coded_size);
+    FreqTableModel<256> model;
+    for (size_t i = 0; i < size; ++i)
+        out[i] = (uint8_t) model.decode(coder);
+    return !coder.overrun();
+}
+
+typedef BitTreeModel<BinShiftModel<5>, 8> BenchTree;
+
+// N independent streams, one per lane of an interleaved coder: "data"
+// is cut into N equal parts, each with its own bit tree, and they're
+// coded in lockstep one tree level at a time (so the i'th symbol of
+// every level lands on lane i). Whatever doesn't divide evenly goes
+// last, through the first tree.
+template<int N>
+static void bench_lanes_encode(ByteVec &out, uint8_t const *data, size_t size)
+{
+    InterleavedBinArithEncoder<N> coder(out);
+    BenchTree models[N];
+    size_t per = size / N;
+    for (size_t i = 0; i < per; ++i)
+    {
+        size_t ctx[N];
+        for (int j = 0; j < N; ++j)
+            ctx[j] = 1;
+
+        for (int level = 7; level >= 0; --level)
+        {
+            for (int j = 0; j < N; ++j)
+            {
+                int bit = (data[j * per + i] >> level) & 1;
+                models[j].model[ctx[j] - 1].encode(coder, bit);
+                ctx[j] += ctx[j] + bit;
+            }
+        }
+    }
+
+    for (size_t i = N * per; i < size; ++i)
+        models[0].encode(coder, data[i]);
+}
+
+// Decode that with decode_lanes.
+template<int N>
+static bool bench_lanes_decode(uint8_t *out, size_t size, uint8_t const *coded, size_t coded_size)
+{
+    InterleavedBinArithDecoder<N> coder(coded, coded_size);
+    BenchTree models[N];
+    size_t per = size / N;
+    for (size_t i = 0; i < per; ++i)
+    {
+        size_t ctx[N];
+        for (int j = 0; j < N; ++j)
+            ctx[j] = 1;
+
+        for (int level = 0; level < 8; ++level)
+        {
+            uint32_t probs[N];
+            int bits[N];
+            for (int j = 0; j < N; ++j)
+                probs[j] = models[j].model[ctx[j] - 1].prob;
+            coder.decode_lanes(probs, bits);
+            for (int j = 0; j < N; ++j)
+            {
+                models[j].model[ctx[j] - 1].adapt(bits[j]);
+                ctx[j] += ctx[j] + bits[j];
+            }
+        }
+
+        for (int j = 0; j < N; ++j)
+            out[j * per + i] = (uint8_t)(ctx[j] - 256);
+    }
+
+    for (size_t i = N * per; i < size; ++i)
+        out[i] = (uint8_t) models[0].decode(coder);
+    return !coder.overrun();
+}
+
+static BenchCodec const kBenchCodecs[] =
+{
+    // Binary models
+    { "shift4", true, bench_bits_encode<BinShiftModel<4>, BinArithEncoder>,
+        bench_bits_decode<BinShiftModel<4>, BinArithDecoder> },
+    { "shift5", true, bench_bits_encode<BinShiftModel<5>, BinArithEncoder>,
+        bench_bits_decode<BinShiftModel<5>, BinArithDecoder> },
+    { "two-rate2/5", true, bench_bits_encode<BinTwoRateModel<2, 5>, BinArithEncoder>,
+        bench_bits_decode<BinTwoRateModel<2, 5>, BinArithDecoder> },
+    { "var-rate5", true, bench_bits_encode<BinVarRateModel<5>, BinArithEncoder>,
+        bench_bits_decode<BinVarRateModel<5>, BinArithDecoder> },
+    { "state", true, bench_bits_encode<BinStateModel, BinArithEncoder>,
+        bench_bits_decode<BinStateModel, BinArithDecoder> },
+
+    // Other probability resolutions (and state widths). The -pN coders
+    // are the same code as shift5 with other shift constants, so they
+    // should run at the same speed; a big gap in one run is noise
+    // (check with more -r).
+    { "shift5-p8", true, bench_bits_encode<BinShiftModel<5, 8>, BasicBinArithEncoder<8> >,
+        bench_bits_decode<BinShiftModel<5, 8>, BasicBinArithDecoder<8> > },
+    { "shift5-p15", true, bench_bits_encode<BinShiftModel<5, 15>, BasicBinArithEncoder<15> >,
+        bench_bits_decode<BinShiftModel<5, 15>, BasicBinArithDecoder<15> > },
+    { "shift5-w15", true, bench_bits_encode<BinShiftModel<5, 15>, BasicBinArithEncoder64<15> >,
+        bench_bits_decode<BinShiftModel<5, 15>, BasicBinArithDecoder64<15> > },
+    { "bittree5-p15", false, bench_tree_encode<BitTreeModel<BinShiftModel<5, 15>, 8>, BasicBinArithEncoder<15> >,
+        bench_tree_decode<BitTreeModel<BinShiftModel<5, 15>, 8>, BasicBinArithDecoder<15> > },
+
+    // Byte models and backends
+    { "bittree4", false, bench_tree_encode<BitTreeModel<BinShiftModel<4>, 8>, BinArithEncoder>,
+        bench_tree_decode<BitTreeModel<BinShiftModel<4>, 8>, BinArithDecoder> },
+    { "bittree5", false, bench_tree_encode<BenchTree, BinArithEncoder>, bench_tree_decode<BenchTree, BinArithDecoder> },
+    { "bittree5-batch", false, bench_batch_encode<BenchTree>, bench_batch_decode<BenchTree> },
+    { "unrolled5", false, arith_encode, arith_decode },
+    { "blocked5", false, bench_batch_encode<BlockedBitTreeModel<BinShiftModel<5>, 8> >,
+        bench_batch_decode<BlockedBitTreeModel<BinShiftModel<5>, 8> > },
+    { "packed4", false, bench_batch_encode<BlockedBitTreeModel<PackedBinShiftModel<4>, 8> >,
+        bench_batch_decode<BlockedBitTreeModel<PackedBinShiftModel<4>, 8> > },
+    { "interleaved4", false, bench_tree_encode<BenchTree, InterleavedBinArithEncoder<4> >,
+        bench_tree_decode<BenchTree, InterleavedBinArithDecoder<4> > },
+    { "lanes4", false, bench_lanes_encode<4>, bench_lanes_decode<4> },
+    { "lanes8", false, bench_lanes_encode<8>, bench_lanes_decode<8> },
+    { "range", false, bench_range_encode, bench_range_decode },
+    { "rans", false, rans_encode, rans_decode },
+    { "lz", false, lz_encode, lz_decode },
+    { "cm", false, bench_tree_encode<ContextMixModel, BinArithEncoder>, bench_tree_decode<ContextMixModel, BinArithDecoder> },
+};
+
+static void mean_stddev(std::vector<double> const &x, double *mean, double *stddev)
+{
+    double sum = 0.0, sum2 = 0.0;
+    for (size_t i = 0; i < x.size(); ++i)
+    {
+        sum += x[i];
+        sum2 += x[i] * x[i];
+    }
+    *mean = sum / x.size();
+    double var = sum2 / x.size() - *mean * *mean;
+    *stddev = var > 0.0 ? sqrt(var) : 0.0;
+}
+
+// Run all codecs whose name contains "filter" (if given) over all
+// sources, "runs" times each. Returns false if anything fails to
+// round-trip.
+static bool run_bench_suite(std::vector<BenchSource> const &sources, int runs, char const *filter)
+{
+    bool all_ok = true;
+    int num_codecs = (int)(sizeof(kBenchCodecs) / sizeof(kBenchCodecs[0]));
+
+    for (size_t s = 0; s < sources.size(); ++s)
+    {
+        BenchSource const &src = sources[s];
+        size_t size = src.data.size();
+        if (size == 0)
+            continue;
+
+        double source_bits = src.bits ? (double)size : size * 8.0;
+        double entropy = order0_entropy_bytes(&src.data[0], size);
+        printf("%s: %d %s, order-0 entropy %.1f bytes\n", src.name, (int)size, src.bits ? "bits" : "bytes", entropy);
+        printf("  %-15s %10s %8s %17s %17s %9s\n", "codec", "size", "vs H0", "enc MB/s", "dec MB/s", "dec c/bit");
+
+        for (int c = 0; c < num_codecs; ++c)
+        {
+            BenchCodec const &codec = kBenchCodecs[c];
+            if (codec.bits != src.bits || (filter && !strstr(codec.name, filter)))
+                continue;
+
+            ByteVec coded, decoded(size);
+            std::vector<double> enc_rate, dec_rate;
+            uint64_t best_cycles = ~(uint64_t)0;
+            bool ok = true;
+
+            for (int run = 0; run < runs; ++run)
+            {
+                coded.clear();
+                double t0 = timer();
+                codec.encode(coded, &src.data[0], size);
+                double t1 = timer();
+                uint64_t c0 = read_cycles();
+                ok = codec.decode(&decoded[0], size, &coded[0], coded.size()) && ok;
+                uint64_t c1 = read_cycles();
+                double t2 = timer();
+
+                // In MB/s of source data (bits / 8)
+                enc_rate.push_back(source_bits / 8e6 / (t1 - t0));
+                dec_rate.push_back(source_bits / 8e6 / (t2 - t1));
+                if (c1 - c0 < best_cycles)
+                    best_cycles = c1 - c0;
+            }
+            ok = ok && decoded == src.data;
+
+            double enc_mean, enc_sd, dec_mean, dec_sd;
+            mean_stddev(enc_rate, &enc_mean, &enc_sd);
+            mean_stddev(dec_rate, &dec_mean, &dec_sd);
+
+            char cycles[32];
+            if (have_cycle_counter())
+                snprintf(cycles, sizeof(cycles), "%.2f", best_cycles / source_bits);
+            else
+                snprintf(cycles, sizeof(cycles), "-");
+
+            printf("  %-15s %10d %7.3fx %8.1f +- %5.1f %8.1f +- %5.1f %9s%s\n", codec.name, (int)coded.size(),
+                entropy > 0.0 ? coded.size() / entropy : 0.0, enc_mean, enc_sd, dec_mean, dec_sd, cycles,
+                ok ? "" : "  MISMATCH!");
+            if (!ok)
+                all_ok = false;
+        }
+    }
+
+    return all_ok;
+}
+
+// The synthetic sources: binary static and drifting, like
+// example_static and example_dynamic but bigger, plus skewed bytes.
+static void add_synthetic_sources(std::vector<BenchSource> &sources)
+{
+    static size_t const kCount = 1 << 20;
+    uint32_t seed = 1234;
+    sources.resize(sources.size() + 3);
+    BenchSource *src = &sources[sources.size() - 3];
+
+    src[0].name = "static-bits";
+    src[0].bits = true;
+    src[0].data.resize(kCount);
+    for (size_t i = 0; i < kCount; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        src[0].data[i] = (seed >> 16) < 65536 / 5;
+    }
+
+    src[1].name = "drifting-bits";
+    src[1].bits = true;
+    src[1].data.resize(kCount);
+    uint32_t threshold = 0;
+    for (size_t i = 0; i < kCount; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        if (i % 200 == 0)
+            threshold = seed >> 16;
+        seed = seed * 1664525 + 1013904223;
+        src[1].data[i] = (seed >> 16) < threshold;
+    }
+
+    src[2].name = "skewed-bytes";
+    src[2].bits = false;
+    src[2].data.resize(kCount);
+    for (size_t i = 0; i < kCount; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        uint32_t r = seed >> 24;
+        src[2].data[i] = (uint8_t) (r < 224 ? 0 : r & 15);
+    }
+}
+
+// ---- Command-line tool
+
+// More than that is a typo, not a machine.
+static int const kMaxThreads = 1024;
+
+struct CliOptions
+{
+    int threads; // 0 = one per core
+    size_t block_size;
+    uint64_t max_output; // for decompress
+    BlockBackend backend;
+    int runs; // for bench and suite
+    char const *filter; // codec name filter for suite
+    char const *stats_file; // where to dump stats as JSON
+
+    CliOptions() : threads(0), block_size(1 << 20), max_output(kDefaultMaxOutput), backend(kBackendAuto), runs(3), filter(0), stats_file(0) { }
+};
+
+static void print_usage()
+{
+    fprintf(stderr,
+        "usage: mini_arith                           run the examples\n"
+        "       mini_arith compress [opts] in out     (\"-\" = stdin/stdout)\n"
+        "       mini_arith decompress [opts] in out\n"
+        "       mini_arith bench [opts] files...      container round trip\n"
+        "       mini_arith suite [opts] [files...]    all coders and models, on\n"
+        "                                             synthetic sources plus files\n"
+        "options:\n"
+        "  -t N        threads, up to 1024 (default or 0: one per core)\n"
+        "  -b SIZE     block size, with optional k/m suffix (default: 1m, max: 64m)\n"
+        "  -m SIZE     decompress: fail if the output would be larger\n"
+        "              (k/m/g suffix, default: 4g)\n"
+        "  -e BACKEND  arith, rans, lz or auto (default: auto)\n"
+        "  -r N        runs per file (default: 3)\n"
+        "  -c NAME     suite: only codecs with NAME in their name\n"
+        "  -s FILE     write coder stats as JSON (MINI_ARITH_STATS=1 builds,\n"
+        "              runs single-threaded)\n");
+}
+
+// Parse a size like "65536", "64k", "1m" or "2g", between 1 and "max".
+static bool parse_size(char const *str, uint64_t max, uint64_t *out)
+{
+    char *end;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str || *str == '-')
+        return false;
+
+    int shift = 0;
+    if (*end == 'k' || *end == 'K')
+        shift = 10, ++end;
+    else if (*end == 'm' || *end == 'M')
+        shift = 20, ++end;
+    else if (*end == 'g' || *end == 'G')
+        shift = 30, ++end;
+    if (*end != 0 || value == 0 || value > (max >> shift))
+        return false;
+    *out = (uint64_t)value << shift;
+    return true;
+}
+
+// Parse a plain decimal number between "min" and "max".
+static bool parse_int(char const *str, long min, long max, int *out)
+{
+    char *end;
+    long value = strtol(str, &end, 10);
+    if (end == str || *end != 0 || value < min || value > max)
+        return false;
+    *out = (int)value;
+    return true;
+}
+
+// Parse options starting at argv[*pos]; afterwards, *pos is the first
+// non-option argument. Returns false on bad options.
+static bool parse_options(int argc, char **argv, int *pos, CliOptions &opts)
+{
+    int i = *pos;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != 0; ++i)
+    {
+        char const *opt = argv[i];
+        if (opt[1] == 0 || opt[2] != 0 || i + 1 >= argc)
+            return false;
+
+        char const *arg = argv[++i];
+        uint64_t size;
+        switch (opt[1])
+        {
+        case 't':
+            if (!parse_int(arg, 0, kMaxThreads, &opts.threads))
+                return false;
+            break;
+
+        case 'r':
+            if (!parse_int(arg, 1, 1000000, &opts.runs))
+                return false;
+            break;
+
+        case 'b':
+            if (!parse_size(arg, kMaxBlockSize, &size))
+                return false;
+            opts.block_size = (size_t)size;
+            break;
+
+        case 'm':
+            if (!parse_size(arg, UINT64_MAX, &opts.max_output))
+                return false;
+            break;
+
+        case 'c':
+            opts.filter = arg;
+            break;
+
+        case 's':
+            opts.stats_file = arg;
+            break;
+
+        case 'e':
+            if (strcmp(arg, "arith") == 0)
+                opts.backend = kBackendArith;
+            else if (strcmp(arg, "rans") == 0)
+                opts.backend = kBackendRans;
+            else if (strcmp(arg, "lz") == 0)
+                opts.backend = kBackendLz;
+            else if (strcmp(arg, "auto") == 0)
+                opts.backend = kBackendAuto;
+            else
+                return false;
+            break;
+
+        default:
+            return false;
+        }
+    }
+
+    *pos = i;
+    return true;
+}
+
+static void report(char const *what, uint64_t in_size, uint64_t out_size, uint64_t raw_size, double secs)
+{
+    fprintf(stderr, "%s %llu -> %llu bytes in %.3fs, %.1f MB/s\n", what,
+        (unsigned long long)in_size, (unsigned long long)out_size,
+        secs, secs > 0.0 ? raw_size / 1e6 / secs : 0.0);
+}
+
+static int cli_compress(char const *in_name, char const *out_name, CliOptions const &opts)
+{
+    OutputFile out;
+    if (!out.open_file(out_name))
+    {
+        fprintf(stderr, "can't open \"%s\" for writing\n", out_name);
+        return 1;
+    }
+
+    double t0 = timer();
+    uint64_t in_size = 0;
+    {
+        StreamSink sink(OutputFile::write_func, &out, 1 << 20);
+        ContainerWriter writer(sink, opts.block_size, opts.threads, opts.backend);
+
+        if (strcmp(in_name, "-") == 0)
+        {
+            // Compress stdin as it comes in, a batch at a time.
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            ByteVec buf(writer.batch_bytes());
+            size_t got;
+            do
+            {
+                got = 0;
+                while (got < buf.size())
+                {
+                    size_t n = fread(&buf[got], 1, buf.size() - got, stdin);
+                    if (n == 0)
+                        break;
+                    got += n;
+                }
+                writer.add_data(&buf[0], got);
+                in_size += got;
+            } while (got == buf.size());
+
+            if (ferror(stdin))
+            {
+                fprintf(stderr, "error reading stdin\n");
+                return 1;
+            }
+        }
+        else
+        {
+            InputFile in;
+            if (!in.open_file(in_name))
+            {
+                fprintf(stderr, "can't read \"%s\"\n", in_name);
+                return 1;
+            }
+            writer.add_data(in.data(), in.size());
+            in_size = in.size();
+        }
+
+        writer.finish();
+    }
+
+    if (!out.close())
+    {
+        fprintf(stderr, "error writing \"%s\"\n", out_name);
+        return 1;
+    }
+
+    report("compressed", in_size, out.written, in_size, timer() - t0);
+    return 0;
+}
+
+static int cli_decompress(char const *in_name, char const *out_name, CliOptions const &opts)
+{
+    InputFile in;
+    if (!in.open_file(in_name))
+    {
+        fprintf(stderr, "can't read \"%s\"\n", in_name);
+        return 1;
+    }
+
+    OutputFile out;
+    if (!out.open_file(out_name))
+    {
+        fprintf(stderr, "can't open \"%s\" for writing\n", out_name);
+        return 1;
+    }
+
+    double t0 = timer();
+    DecodeStatus status;
+    {
+        StreamSink sink(OutputFile::write_func, &out, 1 << 20);
+        status = try_decompress(sink, in.data(), in.size(), opts.threads, opts.max_output);
+    }
+
+    if (!out.close())
+    {
+        fprintf(stderr, "error writing \"%s\"\n", out_name);
+        return 1;
+    }
+    if (status != kDecodeOk)
+    {
+        fprintf(stderr, "\"%s\": %s\n", in_name, decode_status_name(status));
+        return 1;
+    }
+
+    report("decompressed", in.size(), out.written, out.written, timer() - t0);
+    return 0;
+}
+
+static int cli_bench(int argc, char **argv, int first, CliOptions const &opts)
+{
+    int result = 0;
+    for (int i = first; i < argc; ++i)
+    {
+        InputFile in;
+        if (!in.open_file(argv[i]))
+        {
+            fprintf(stderr, "can't read \"%s\"\n", argv[i]);
+            result = 1;
+            continue;
+        }
+
+        // Best of "runs" runs.
+        ByteVec coded, decoded;
+        double best_comp = 1e30, best_decomp = 1e30;
+        bool ok = true;
+        for (int run = 0; run < opts.runs; ++run)
+        {
+            double t0 = timer();
+            compress(coded, in.data(), in.size(), opts.block_size, opts.threads, opts.backend);
+            double t1 = timer();
+            ok = decompress(decoded, &coded[0], coded.size(), opts.threads) && ok;
+            double t2 = timer();
+
+            best_comp = t1 - t0 < best_comp ? t1 - t0 : best_comp;
+            best_decomp = t2 - t1 < best_decomp ? t2 - t1 : best_decomp;
+        }
+        ok = ok && decoded.size() == in.size() && (in.size() == 0 || memcmp(&decoded[0], in.data(), in.size()) == 0);
+
+        double mb = in.size() / 1e6;
+        printf("%s: %llu -> %llu bytes (%.2f%%), comp %.1f MB/s, decomp %.1f MB/s%s\n", argv[i],
+            (unsigned long long)in.size(), (unsigned long long)coded.size(),
+            in.size() ? 100.0 * coded.size() / in.size() : 0.0,
+            mb / best_comp, mb / best_decomp, ok ? "" : " MISMATCH!");
+        if (!ok)
+            result = 1;
+    }
+
+    return result;
+}
+
+static int cli_suite(int argc, char **argv, int first, CliOptions const &opts)
+{
+    std::vector<BenchSource> sources;
+    add_synthetic_sources(sources);
+
+    for (int i = first; i < argc; ++i)
+    {
+        sources.resize(sources.size() + 1);
+        BenchSource &src = sources.back();
+        src.name = argv[i];
+        src.bits = false;
+        if (!read_file(argv[i], src.data))
+        {
+            fprintf(stderr, "can't read \"%s\"\n", argv[i]);
+            return 1;
+        }
+    }
+
+    return run_bench_suite(sources, opts.runs, opts.filter) ? 0 : 1;
+}
+
+static int run_cli(int argc, char **argv)
+{
+    CliOptions opts;
+    char const *cmd = argv[1];
+    int pos = 2;
+    if (!parse_options(argc, argv, &pos, opts))
+    {
+        print_usage();
+        return 2;
+    }
+
+    if (opts.stats_file)
+    {
+#if MINI_ARITH_STATS
+        opts.threads = 1; // stats are per thread
+        coder_stats().reset();
+#else
+        fprintf(stderr, "-s needs a build with MINI_ARITH_STATS=1\n");
+        return 2;
+#endif
+    }
+
+    int result;
+    if (strcmp(cmd, "compress") == 0 && argc - pos == 2)
+        result = cli_compress(argv[pos], argv[pos + 1], opts);
+    else if (strcmp(cmd, "decompress") == 0 && argc - pos == 2)
+        result = cli_decompress(argv[pos], argv[pos + 1], opts);
+    else if (strcmp(cmd, "bench") == 0 && argc - pos >= 1)
+        result = cli_bench(argc, argv, pos, opts);
+    else if (strcmp(cmd, "suite") == 0)
+        result = cli_suite(argc, argv, pos, opts);
+    else
+    {
+        print_usage();
+        return 2;
+    }
+
+#if MINI_ARITH_STATS
+    if (opts.stats_file)
+    {
+        FILE *f = fopen(opts.stats_file, "w");
+        if (!f)
+        {
+            fprintf(stderr, "can't write \"%s\"\n", opts.stats_file);
+            return 1;
+        }
+        coder_stats().dump_json(f);
+        fclose(f);
+    }
+#endif
+
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    // With arguments, it's the command-line tool; without, run the examples.
+    if (argc > 1)
+        return run_cli(argc, argv);
+
     example_static();
     example_dynamic();
     example_multisymbol();
+    example_interleaved();
+    example_lanes();
+    example_blocks();
+    example_damaged();
+    example_streaming();
+    example_resumable();
+    example_order1();
+    example_context_mix();
+    example_warmup();
+    example_bypass();
+    example_range();
+    example_small_messages();
+    example_dictionary();
+    example_wide();
+    example_cost();
+    example_lz();
+    example_multistream();
     return 0;
 }
 
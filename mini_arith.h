@@ -0,0 +1,5295 @@
+// Simple byte-aligned binary arithmetic coder (Ilya Muravyov's variant) - public domain - Fabian 'ryg' Giesen 2015
+//
+// Written for clarity not speed!
+//
+// This is the library part: sinks and sources, the coders, the models,
+// and the block container on top. It's header-only; just include it.
+// Everything is either a template or inline, so there's nothing to
+// link, and the compiler gets to see (and inline) all of the hot paths
+// in whatever translation unit uses them. main.cpp has the examples,
+// benchmarks and the command-line tool; mini_arith_c.h is a plain C
+// interface for calling this from other languages.
+//
+// Everything is in namespace mini_arith, except for the MINI_ARITH_*
+// macros. The configuration macros (MINI_ARITH_STATS,
+// MINI_ARITH_CLZ_RENORM, MINI_ARITH_NO_SIMD) change class layouts and
+// code, so they must be the same in every translation unit of a
+// program; mixing them breaks the one-definition rule.
+
+#ifndef MINI_ARITH_H
+#define MINI_ARITH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <thread> // C++11 from here on
+#include <atomic>
+#include <exception>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifndef MINI_ARITH_NO_SIMD
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MINI_ARITH_X86
+#include <immintrin.h>
+#ifndef _MSC_VER
+#include <cpuid.h>
+#endif
+#endif
+#endif
+
+// For functions using instruction set extensions we check for at runtime.
+#if defined(__GNUC__) && !defined(_MSC_VER)
+#define MINI_ARITH_TARGET(x) __attribute__((target(x)))
+#else
+#define MINI_ARITH_TARGET(x)
+#endif
+
+#ifdef _MSC_VER
+#define MINI_ARITH_FORCEINLINE __forceinline
+#else
+#define MINI_ARITH_FORCEINLINE inline __attribute__((always_inline))
+#endif
+
+// Set to 1 to renormalize with a single clz and an unaligned 32-bit
+// store/load instead of a loop that moves a byte at a time. Both produce
+// the exact same bitstream; which one is faster depends on the data
+// (and the CPU), so measure.
+#ifndef MINI_ARITH_CLZ_RENORM
+#define MINI_ARITH_CLZ_RENORM 0
+#endif
+
+// Set to 1 for a stats build: the binary coders and bit trees then
+// record what they're doing (see CoderStats). Costs a lot of speed, so
+// it's off by default, and then the hooks compile to nothing.
+#ifndef MINI_ARITH_STATS
+#define MINI_ARITH_STATS 0
+#endif
+
+#if MINI_ARITH_STATS
+#define MINI_ARITH_STAT(x) x
+#else
+#define MINI_ARITH_STAT(x)
+#endif
+
+namespace mini_arith {
+
+// Probabilities are expressed in fixed point, with kProbBits bits of
+// resolution. No need to go overboard with this.
+static int const kProbBits = 12;
+static uint32_t const kProbMax = 1u << kProbBits;
+
+// Most bytes a binary coder reads or writes per symbol.
+static size_t const kMaxBytesPerSymbol = 4;
+
+// Type used for buffers.
+typedef std::vector<uint8_t> ByteVec;
+
+// ---- Bit twiddling helpers
+
+// Count leading zeros. x must be nonzero!
+inline int clz32(uint32_t x)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse(&index, x);
+    return 31 - (int)index;
+#else
+    return __builtin_clz(x);
+#endif
+}
+
+// Number of leading zero bytes in x (0-4).
+inline uint32_t leading_zero_bytes(uint32_t x)
+{
+    // x|1 keeps clz defined; the x==0 term supplies the 4th byte.
+    return (clz32(x | 1) >> 3) + (x == 0);
+}
+
+// Unaligned big-endian 32-bit loads and stores. Compilers turn these
+// into a single load/store (plus byte swap where needed).
+inline uint32_t load_be32(uint8_t const *p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+// Hint that we're going to need the cache line at p soon.
+inline void prefetch_mem(void const *p)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(p);
+#elif defined(MINI_ARITH_X86)
+    _mm_prefetch((char const *)p, _MM_HINT_T0);
+#else
+    (void)p;
+#endif
+}
+
+inline void store_be32(uint8_t *p, uint32_t x)
+{
+    p[0] = (uint8_t)(x >> 24);
+    p[1] = (uint8_t)(x >> 16);
+    p[2] = (uint8_t)(x >> 8);
+    p[3] = (uint8_t)x;
+}
+
+// Little-endian, for headers.
+inline uint32_t load_le32(uint8_t const *p)
+{
+    return p[0] | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+inline void put_le32(ByteVec &v, uint32_t x)
+{
+    for (int i = 0; i < 4; ++i)
+        v.push_back((uint8_t)(x >> (i*8)));
+}
+
+// ---- Output sinks
+
+// Encoders write through a raw cursor [cur, end). The fast path is just
+// "*cur++ = byte"; the coder checks for room once per symbol via reserve()
+// and only calls into the (virtual) slow path when the buffer is full.
+// That's where sinks grow their buffer or hand the bytes written so far
+// off to somewhere else.
+class ByteSink
+{
+    // noncopyable
+    ByteSink(ByteSink const &);
+    ByteSink &operator =(ByteSink const &);
+
+public:
+    uint8_t *cur; // next byte gets written here
+    uint8_t *end; // end of writable region
+
+    // Most bytes a single reserve() may ask for.
+    static size_t const kMaxReserve = 64;
+
+    ByteSink() : cur(0), end(0) { }
+    virtual ~ByteSink() { }
+
+    // Make sure there's room for at least "count" bytes at cur.
+    void reserve(size_t count)
+    {
+        if ((size_t)(end - cur) < count)
+            make_room(count);
+    }
+
+    // Write a block of bytes.
+    void write(uint8_t const *data, size_t count)
+    {
+        while (count)
+        {
+            size_t want = count;
+            if (want > kMaxReserve)
+                want = kMaxReserve;
+
+            reserve(want);
+            size_t chunk = end - cur;
+            if (chunk > count)
+                chunk = count;
+            for (size_t i = 0; i < chunk; ++i)
+                cur[i] = data[i];
+            cur += chunk;
+            data += chunk;
+            count -= chunk;
+        }
+    }
+
+    // Called by the encoder once it's written its last byte.
+    virtual void flush() { }
+
+protected:
+    // Slow path of reserve(): must leave room for at least "count"
+    // bytes at cur.
+    virtual void make_room(size_t count) = 0;
+};
+
+// Appends to a ByteVec. The vector is grown in bulk, so while encoding
+// is in progress, its size() includes some slack past the bytes
+// actually written. flush() trims that back off.
+class VecSink : public ByteSink
+{
+    ByteVec *vec;
+
+public:
+    VecSink() : vec(0) { }
+    explicit VecSink(ByteVec &target) : vec(&target) { }
+    ~VecSink() { flush(); }
+
+    // Start appending to "target" instead.
+    void attach(ByteVec &target)
+    {
+        flush();
+        vec = &target;
+    }
+
+    virtual void flush()
+    {
+        if (cur)
+        {
+            vec->resize(cur - &(*vec)[0]);
+            cur = end = 0;
+        }
+    }
+
+protected:
+    virtual void make_room(size_t count)
+    {
+        // No cursor means nothing has been written since the last flush.
+        size_t used = cur ? cur - &(*vec)[0] : vec->size();
+        size_t new_size = vec->size() * 2;
+        if (new_size < used + count)
+            new_size = used + count;
+        if (new_size < 256)
+            new_size = 256;
+
+        vec->resize(new_size);
+        cur = &(*vec)[0] + used;
+        end = &(*vec)[0] + new_size;
+    }
+};
+
+// Writes into a fixed caller-provided buffer, e.g. an mmap'd output
+// file, without any copies. If the output doesn't fit, the rest is
+// discarded but still counted, so the caller can tell it overflowed
+// and how large the buffer would've needed to be.
+class BufferSink : public ByteSink
+{
+    static size_t const kScratchSize = kMaxReserve;
+
+    uint8_t *base, *limit;
+    uint8_t *pos; // write position in the buffer once we're spilling
+    bool spilling;
+    size_t lost; // bytes that didn't fit
+    uint8_t scratch[kScratchSize];
+
+    // When the buffer is (nearly) full, writes go to scratch. Move
+    // what we can from there to the tail of the buffer.
+    void drain()
+    {
+        size_t count = cur - scratch;
+        size_t room = limit - pos;
+        size_t copy = count < room ? count : room;
+        for (size_t i = 0; i < copy; ++i)
+            pos[i] = scratch[i];
+        pos += copy;
+        lost += count - copy;
+        cur = scratch;
+    }
+
+public:
+    BufferSink(uint8_t *buf, size_t size)
+    {
+        reset(buf, size);
+    }
+
+    // Start over, writing to a (possibly different) buffer.
+    void reset(uint8_t *buf, size_t size)
+    {
+        base = pos = cur = buf;
+        limit = end = buf + size;
+        spilling = false;
+        lost = 0;
+    }
+
+    // Number of bytes stored in the buffer.
+    size_t size() const { return (spilling ? pos : cur) - base; }
+
+    // Did we run out of space? (Valid after flush.)
+    bool overflowed() const { return lost != 0; }
+
+    // Size the buffer would've needed to be. (Valid after flush.)
+    size_t needed_size() const { return size() + lost; }
+
+    virtual void flush()
+    {
+        if (spilling)
+            drain();
+    }
+
+protected:
+    virtual void make_room(size_t count)
+    {
+        assert(count <= kScratchSize);
+        if (!spilling)
+        {
+            pos = cur;
+            spilling = true;
+        }
+        else
+            drain();
+
+        cur = scratch;
+        end = scratch + kScratchSize;
+    }
+};
+
+// Callback that receives output from a StreamSink.
+typedef void StreamWriteFunc(void *user, uint8_t const *data, size_t size);
+
+// Streams output through a fixed-size buffer: whenever it fills up,
+// the contents get passed to a callback, so memory use stays bounded
+// no matter how much gets encoded.
+class StreamSink : public ByteSink
+{
+    StreamWriteFunc *func;
+    void *user;
+    ByteVec buf;
+
+    void deliver()
+    {
+        if (cur != &buf[0])
+            func(user, &buf[0], cur - &buf[0]);
+        cur = &buf[0];
+    }
+
+public:
+    StreamSink(StreamWriteFunc *write_func, void *write_user, size_t buffer_size = 65536)
+        : func(write_func), user(write_user), buf(buffer_size < kMaxReserve ? kMaxReserve : buffer_size)
+    {
+        cur = &buf[0];
+        end = &buf[0] + buf.size();
+    }
+
+    virtual void flush() { deliver(); }
+
+protected:
+    virtual void make_room(size_t count)
+    {
+        assert(count <= buf.size());
+        deliver();
+    }
+};
+
+// Allocation hooks, so that long-lived objects that own memory (PoolSink,
+// CodingContext) can be backed by an arena or whatever else the app uses.
+// "alloc" must return memory aligned for any basic type (like malloc),
+// or null when it's out; the owner then throws std::bad_alloc, same as
+// a failed new anywhere else in here.
+typedef void *AllocFunc(void *user, size_t size);
+typedef void FreeFunc(void *user, void *ptr);
+
+struct AllocHooks
+{
+    AllocFunc *alloc;
+    FreeFunc *free;
+    void *user;
+};
+
+inline void *default_alloc(void *, size_t size) { return malloc(size); }
+inline void default_free(void *, void *ptr) { free(ptr); }
+
+// malloc and free. (A function rather than a constant, so there's just
+// the one, whatever TU asks for it.)
+inline AllocHooks default_alloc_hooks()
+{
+    AllocHooks hooks = { default_alloc, default_free, 0 };
+    return hooks;
+}
+
+// Writes to a buffer that's kept around between uses: rewind() starts
+// over without giving back the memory, so coding lots of small messages
+// doesn't allocate once the buffer has grown to the largest of them.
+class PoolSink : public ByteSink
+{
+    AllocHooks hooks;
+    uint8_t *buf;
+    size_t capacity;
+
+public:
+    explicit PoolSink(AllocHooks const &alloc_hooks = default_alloc_hooks())
+        : hooks(alloc_hooks), buf(0), capacity(0)
+    {
+    }
+
+    ~PoolSink()
+    {
+        if (buf)
+            hooks.free(hooks.user, buf);
+    }
+
+    // Throw away what's been written so far, keep the memory.
+    void rewind() { cur = buf; }
+
+    uint8_t const *data() const { return buf; }
+    size_t size() const { return cur - buf; }
+
+    virtual void flush() { }
+
+protected:
+    virtual void make_room(size_t count)
+    {
+        size_t used = size();
+        size_t new_capacity = capacity * 2;
+        if (new_capacity < used + count)
+            new_capacity = used + count;
+        if (new_capacity < 256)
+            new_capacity = 256;
+
+        uint8_t *new_buf = (uint8_t *)hooks.alloc(hooks.user, new_capacity);
+        if (!new_buf)
+            throw std::bad_alloc();
+        if (used)
+            memcpy(new_buf, buf, used);
+        if (buf)
+            hooks.free(hooks.user, buf);
+
+        buf = new_buf;
+        capacity = new_capacity;
+        cur = buf + used;
+        end = buf + capacity;
+    }
+};
+
+// ---- Input sources
+
+// Decoders read through a raw cursor [cur, end), same as ByteSink
+// only the other way round. The decoder calls reserve() once per symbol
+// for the most bytes it might consume, and then just does "*cur++".
+class ByteSource
+{
+    // noncopyable
+    ByteSource(ByteSource const &);
+    ByteSource &operator =(ByteSource const &);
+
+public:
+    uint8_t const *cur; // next byte gets read from here
+    uint8_t const *end; // end of readable region
+
+    ByteSource() : cur(0), end(0) { }
+    virtual ~ByteSource() { }
+
+    // Make sure at least "count" bytes can be read at cur.
+    void reserve(size_t count)
+    {
+        if ((size_t)(end - cur) < count)
+            refill(count);
+    }
+
+    // Has the decoder read past the end of the input?
+    virtual bool overrun() const = 0;
+
+protected:
+    // Slow path of reserve(): must leave at least "count" readable
+    // bytes at cur.
+    virtual void refill(size_t count) = 0;
+};
+
+// Reads straight out of a memory buffer (an mmap'd file, a network
+// buffer, ...) without copying. Past the end, there's an infinite
+// supply of zero bytes.
+//
+// To keep bounds checks out of the hot path, we read in place until
+// we get within a few bytes of the end, then copy what's left to a
+// small zero-padded buffer and continue from there.
+class MemSource : public ByteSource
+{
+    static size_t const kTailSize = 64;
+
+    uint8_t const *base;
+    size_t size;
+    size_t tail_pos; // stream position of tail[0]
+    bool in_tail;
+    uint8_t tail[kTailSize];
+
+public:
+    MemSource() : base(0), size(0), tail_pos(0), in_tail(false) { }
+    MemSource(uint8_t const *ptr, size_t count) { attach(ptr, count); }
+
+    // Start reading from [ptr, ptr+count) instead.
+    void attach(uint8_t const *ptr, size_t count)
+    {
+        base = ptr;
+        size = count;
+        tail_pos = 0;
+        in_tail = false;
+        cur = ptr;
+        end = ptr + count;
+    }
+
+    // Number of bytes consumed, including any zeros past the end.
+    size_t bytes_read() const { return in_tail ? tail_pos + (cur - tail) : cur - base; }
+
+    virtual bool overrun() const { return bytes_read() > size; }
+
+protected:
+    virtual void refill(size_t count)
+    {
+        assert(count <= kTailSize / 2);
+        size_t pos = bytes_read();
+        size_t left = pos < size ? size - pos : 0;
+
+        for (size_t i = 0; i < kTailSize; ++i)
+            tail[i] = (i < left) ? base[pos + i] : 0;
+
+        tail_pos = pos;
+        in_tail = true;
+        cur = tail;
+        end = tail + kTailSize;
+    }
+};
+
+// Reading past the end is memory safe (it's all zeros), but on garbage
+// or truncated input, a decoder that's been told to produce N symbols
+// would happily spend the time producing them from zeros. Decoders that
+// run on untrusted input check overrun() every kOverrunCheckInterval
+// symbols and bail, so wasted work past the end stays bounded. (Any more
+// often costs measurable speed.)
+static size_t const kOverrunCheckInterval = 4096;
+
+// Input source for streaming: gets fed data in chunks, through a buffer
+// of fixed capacity.
+//
+// The decoder can't wait for more input mid-symbol, so the caller is in
+// charge of suspending: before decoding, check can_read() for the most
+// bytes the next few symbols can consume (kMaxBytesPerSymbol per
+// binary symbol); if there's not enough, feed() more input first, and
+// once there is no more, call end_input(). After that, reads past the
+// end return zeros, just like MemSource.
+//
+// Note the decoder reads 4 bytes as soon as it's constructed, so feed
+// the source first.
+class StreamSource : public ByteSource
+{
+    static size_t const kPadSize = 64;
+
+    ByteVec buf;
+    size_t capacity;
+    uint8_t *data_end; // end of real data in buf
+    bool ended;
+    bool past_end; // read past data_end at some point
+
+public:
+    explicit StreamSource(size_t buffer_size = 65536)
+        : buf(buffer_size + kPadSize), capacity(buffer_size), ended(false), past_end(false)
+    {
+        cur = end = data_end = &buf[0];
+    }
+
+    // Number of buffered bytes not read yet.
+    size_t available() const { return cur < data_end ? data_end - cur : 0; }
+
+    // Can we read "count" bytes without running dry?
+    bool can_read(size_t count) const { return ended || available() >= count; }
+
+    // Append up to "size" bytes of input. Returns how many were taken;
+    // fewer than "size" means the buffer is full, so decode some first.
+    size_t feed(uint8_t const *data, size_t size)
+    {
+        assert(!ended);
+
+        // Move what's left to the front, then append.
+        size_t left = available();
+        uint8_t *base = &buf[0];
+        for (size_t i = 0; i < left; ++i)
+            base[i] = cur[i];
+
+        size_t take = capacity - left;
+        if (take > size)
+            take = size;
+        for (size_t i = 0; i < take; ++i)
+            base[left + i] = data[i];
+
+        cur = base;
+        end = data_end = base + left + take;
+        return take;
+    }
+
+    // There's no more input.
+    void end_input()
+    {
+        ended = true;
+    }
+
+    virtual bool overrun() const { return past_end || cur > data_end; }
+
+protected:
+    virtual void refill(size_t count)
+    {
+        assert(count <= kPadSize);
+
+        // Either the input has ended, or the caller didn't check
+        // can_read(). Either way, all we can do is continue with zeros;
+        // the latter also counts as an overrun.
+        if (!ended || cur > data_end)
+            past_end = true;
+
+        size_t left = available();
+        uint8_t *base = &buf[0];
+        for (size_t i = 0; i < left; ++i)
+            base[i] = cur[i];
+        for (size_t i = left; i < left + kPadSize; ++i)
+            base[i] = 0;
+
+        cur = base;
+        data_end = base + left;
+        end = data_end + kPadSize;
+    }
+};
+
+// ---- Statistics
+
+#if MINI_ARITH_STATS
+
+// What the binary coders saw: how many bytes each symbol took to
+// renormalize, the distribution of probabilities they were handed,
+// and what coding cost (-log2 of the probability of the bit actually
+// coded) and how many "misses" (bits coded with probability below 1/2)
+// went where. Models tag the context they're coding in by setting
+// "context"; everything is also broken down by that.
+//
+// One instance per thread (see coder_stats()), so this works with the
+// block-parallel code, but only counts the calling thread.
+struct CoderStats
+{
+    static int const kProbBuckets = 64;
+    static uint32_t const kMaxContexts = 4096; // higher ones get lumped into the last
+
+    struct Context
+    {
+        uint64_t count;
+        uint64_t misses;
+        double cost_bits;
+    };
+
+    uint64_t symbols;
+    uint64_t renorm_bytes[kMaxBytesPerSymbol + 1]; // number of symbols by bytes renormalized
+    uint64_t prob_hist[kProbBuckets]; // probability of a 1, in kProbMax/kProbBuckets steps
+    uint64_t misses;
+    double cost_bits;
+    uint32_t context; // context for the next symbols, 0 = none given
+    Context contexts[kMaxContexts];
+
+    CoderStats() { reset(); }
+
+    void reset()
+    {
+        memset((void *)this, 0, sizeof(*this));
+    }
+
+    // "prob" has "prob_bits" bits of resolution.
+    void add_symbol(int bit, uint32_t prob, int prob_bits = kProbBits)
+    {
+        uint32_t max = 1u << prob_bits;
+        uint32_t coded_prob = bit ? prob : max - prob;
+        double cost = -log2(coded_prob / (double)max);
+        bool miss = coded_prob < max / 2;
+        Context &c = contexts[context < kMaxContexts ? context : kMaxContexts - 1];
+
+        symbols++;
+        prob_hist[(uint64_t)prob * kProbBuckets / (max + 1)]++;
+        misses += miss;
+        cost_bits += cost;
+        c.count++;
+        c.misses += miss;
+        c.cost_bits += cost;
+    }
+
+    void add_renorm(size_t bytes)
+    {
+        renorm_bytes[bytes < kMaxBytesPerSymbol ? bytes : kMaxBytesPerSymbol]++;
+    }
+
+    void dump_json(FILE *f) const
+    {
+        fprintf(f, "{\n  \"symbols\": %llu,\n  \"cost_bits\": %.1f,\n  \"bits_per_symbol\": %.4f,\n  \"misses\": %llu,\n",
+            (unsigned long long)symbols, cost_bits, symbols ? cost_bits / symbols : 0.0, (unsigned long long)misses);
+
+        fprintf(f, "  \"renorm_bytes\": [");
+        for (size_t i = 0; i <= kMaxBytesPerSymbol; ++i)
+            fprintf(f, "%s%llu", i ? ", " : "", (unsigned long long)renorm_bytes[i]);
+
+        fprintf(f, "],\n  \"prob_hist\": [");
+        for (int i = 0; i < kProbBuckets; ++i)
+            fprintf(f, "%s%llu", i ? ", " : "", (unsigned long long)prob_hist[i]);
+
+        fprintf(f, "],\n  \"contexts\": [");
+        bool first = true;
+        for (uint32_t i = 0; i < kMaxContexts; ++i)
+        {
+            Context const &c = contexts[i];
+            if (!c.count)
+                continue;
+            fprintf(f, "%s\n    { \"context\": %u, \"count\": %llu, \"misses\": %llu, \"cost_bits\": %.1f }",
+                first ? "" : ",", i, (unsigned long long)c.count, (unsigned long long)c.misses, c.cost_bits);
+            first = false;
+        }
+        fprintf(f, "\n  ]\n}\n");
+    }
+};
+
+inline CoderStats &coder_stats()
+{
+    static thread_local CoderStats stats;
+    return stats;
+}
+
+#endif // MINI_ARITH_STATS
+
+// Scale "range" by a probability with ProbBits bits of resolution:
+// floor(range * prob / 2^ProbBits), prob < 2^ProbBits. The obvious way
+// is a 32x32->64 bit multiply. On 32-bit targets, that's a multi-
+// instruction affair, so there split the range in a high and a low
+// part instead; with ProbBits <= 16 both partial products fit in 32
+// bits, and the result is exactly the same. (On 64-bit targets the
+// wide multiply is as fast as a narrow one, so don't bother.)
+template<int ProbBits>
+MINI_ARITH_FORCEINLINE uint32_t scale_range(uint32_t range, uint32_t prob)
+{
+    if (sizeof(void *) < 8)
+        return (range >> ProbBits) * prob + (((range & ((1u << ProbBits) - 1)) * prob) >> ProbBits);
+    else
+        return uint32_t((uint64_t(range) * prob) >> ProbBits);
+}
+
+// Binary arithmetic encoder (Ilya Muravyov's variant)
+// Encodes/decodes a string of binary (0/1) events with
+// probabilities that are not 1/2.
+//
+// This code is written for clarity, not performance.
+//
+// ProbBits is the resolution of the probabilities passed to encode();
+// models have the same parameter and the two need to agree. Up to 16
+// bits. BinArithEncoder is the kProbBits version everything else uses.
+template<int ProbBits>
+class BasicBinArithEncoder
+{
+    typedef char prob_bits_must_be_1_to_16[ProbBits >= 1 && ProbBits <= 16 ? 1 : -1];
+
+    uint32_t lo, hi;
+    bool finished;
+    VecSink vec_sink; // only used when writing to a ByteVec
+    ByteSink &sink;
+
+    friend class BinArithEncoderBatch;
+
+    // noncopyable
+    BasicBinArithEncoder(BasicBinArithEncoder const &);
+    BasicBinArithEncoder &operator =(BasicBinArithEncoder const &);
+
+    // Renormalize: when top byte of lo/hi is same, shift it out.
+    MINI_ARITH_FORCEINLINE void renorm()
+    {
+        MINI_ARITH_STAT(coder_stats().add_renorm(leading_zero_bytes(lo ^ hi)));
+#if MINI_ARITH_CLZ_RENORM
+        // Figure out how many top bytes match all at once. Always store
+        // 4 bytes but only advance by that many, so there's no
+        // data-dependent branch.
+        uint32_t nbits = leading_zero_bytes(lo ^ hi) * 8;
+        sink.reserve(4);
+        store_be32(sink.cur, lo);
+        sink.cur += nbits >> 3;
+        lo = uint32_t(uint64_t(lo) << nbits);
+        hi = ~uint32_t(uint64_t(~hi) << nbits); // shift in 1 bits
+#else
+        // That's at most 4 bytes per symbol, so one check for space
+        // up front covers it.
+        if ((lo ^ hi) < (1u << 24))
+        {
+            sink.reserve(4);
+            uint8_t *out = sink.cur;
+            do
+            {
+                *out++ = lo >> 24;
+                lo <<= 8;
+                hi = (hi << 8) | 0xff;
+            } while ((lo ^ hi) < (1u << 24));
+            sink.cur = out;
+        }
+#endif
+    }
+
+public:
+    // Resolution of the probabilities encode() takes. Models check
+    // theirs against this, so a mismatch doesn't compile.
+    static int const kProbBits = ProbBits;
+
+    // Initialize, appending output to "target"
+    explicit BasicBinArithEncoder(ByteVec &target) : lo(0), hi(~0u), finished(false), vec_sink(target), sink(vec_sink) { }
+
+    // Initialize, writing output to "target"
+    explicit BasicBinArithEncoder(ByteSink &target) : lo(0), hi(~0u), finished(false), sink(target) { }
+
+    ~BasicBinArithEncoder() { finish(); }
+
+    // Finish encoding - flushes remaining codeword and the sink. The
+    // destructor does this if you don't.
+    void finish()
+    {
+        if (finished)
+            return;
+
+        sink.reserve(4);
+        for (int i = 0; i < 4; ++i)
+        {
+            *sink.cur++ = lo >> 24;
+            lo <<= 8;
+        }
+        sink.flush();
+        finished = true;
+    }
+
+    // Encode a binary symbol "bit" with the probability of a 1 being "prob".
+    // Note that prob=0 (or prob=1<<ProbBits) really mean that a 1 (or 0,
+    // respectively) cannot occur!
+    MINI_ARITH_FORCEINLINE void encode(int bit, uint32_t prob)
+    {
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, prob, ProbBits));
+
+        // Midpoint of active probability interval subdivided via prob
+        uint32_t x = lo + scale_range<ProbBits>(hi - lo, prob);
+
+        if (bit)
+            hi = x;
+        else
+            lo = x + 1;
+
+        renorm();
+    }
+
+    // Encode a "bypass" bit: equiprobable, no model. Same result as
+    // encode(bit, kProbMax / 2), but the midpoint is just a shift.
+    void encode_bypass(int bit)
+    {
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, kProbMax / 2));
+        uint32_t x = lo + ((hi - lo) >> 1);
+
+        if (bit)
+            hi = x;
+        else
+            lo = x + 1;
+
+        renorm();
+    }
+
+    // Encode the low "nbits" bits of "value" as bypass bits, MSB first.
+    // Same as that many encode_bypass() calls, but keeps lo/hi in
+    // registers for the whole batch. (Stores through the uint8_t output
+    // pointer may alias anything, so the compiler can't do that for us.)
+    void encode_bits(uint32_t value, int nbits)
+    {
+        assert(nbits >= 0 && nbits <= 16);
+        uint32_t l = lo, h = hi;
+
+        for (int i = nbits - 1; i >= 0; --i)
+        {
+            // Raw bits are coin flips, so don't branch on them.
+            uint32_t x = l + ((h - l) >> 1);
+            uint32_t mask = 0 - ((value >> i) & 1);
+            h = (x & mask) | (h & ~mask);
+            l = ((x + 1) & ~mask) | (l & mask);
+            MINI_ARITH_STAT(coder_stats().add_symbol((value >> i) & 1, kProbMax / 2));
+            MINI_ARITH_STAT(coder_stats().add_renorm(leading_zero_bytes(l ^ h)));
+
+            if ((l ^ h) < (1u << 24))
+            {
+                sink.reserve(4);
+                uint8_t *out = sink.cur;
+                do
+                {
+                    *out++ = l >> 24;
+                    l <<= 8;
+                    h = (h << 8) | 0xff;
+                } while ((l ^ h) < (1u << 24));
+                sink.cur = out;
+            }
+        }
+
+        lo = l;
+        hi = h;
+    }
+};
+
+typedef BasicBinArithEncoder<kProbBits> BinArithEncoder;
+
+// Corresponding decoder.
+template<int ProbBits>
+class BasicBinArithDecoder
+{
+    typedef char prob_bits_must_be_1_to_16[ProbBits >= 1 && ProbBits <= 16 ? 1 : -1];
+
+    uint32_t code, lo, hi;
+    MemSource mem_source; // only used when reading from memory
+    ByteSource &src;
+
+    friend class BinArithDecoderBatch;
+
+    // noncopyable
+    BasicBinArithDecoder(BasicBinArithDecoder const &);
+    BasicBinArithDecoder &operator =(BasicBinArithDecoder const &);
+
+    // Renormalize: shift out matching top bytes, shift in new code bytes.
+    MINI_ARITH_FORCEINLINE void renorm()
+    {
+        MINI_ARITH_STAT(coder_stats().add_renorm(leading_zero_bytes(lo ^ hi)));
+#if MINI_ARITH_CLZ_RENORM
+        // Same idea as in the encoder: always load 4 bytes, consume
+        // only as many as we need.
+        uint32_t nbits = leading_zero_bytes(lo ^ hi) * 8;
+        src.reserve(4);
+        code = uint32_t(((uint64_t(code) << 32) | load_be32(src.cur)) >> (32 - nbits));
+        src.cur += nbits >> 3;
+        lo = uint32_t(uint64_t(lo) << nbits);
+        hi = ~uint32_t(uint64_t(~hi) << nbits);
+#else
+        if ((lo ^ hi) < (1u << 24))
+        {
+            src.reserve(4);
+            uint8_t const *in = src.cur;
+            do
+            {
+                code = (code << 8) | *in++;
+                lo <<= 8;
+                hi = (hi << 8) | 0xff;
+            } while ((lo ^ hi) < (1u << 24));
+            src.cur = in;
+        }
+#endif
+    }
+
+    void init()
+    {
+        src.reserve(4);
+        code = 0;
+        for (int i = 0; i < 4; ++i)
+            code = (code << 8) | *src.cur++;
+    }
+
+public:
+    static int const kProbBits = ProbBits; // see BasicBinArithEncoder
+
+    // Start decoding from a ByteVec
+    explicit BasicBinArithDecoder(ByteVec const &source)
+        : lo(0), hi(~0u), mem_source(source.empty() ? 0 : &source[0], source.size()), src(mem_source)
+    {
+        init();
+    }
+
+    // Start decoding from memory, no copies
+    BasicBinArithDecoder(uint8_t const *ptr, size_t size)
+        : lo(0), hi(~0u), mem_source(ptr, size), src(mem_source)
+    {
+        init();
+    }
+
+    // Start decoding from an arbitrary source
+    explicit BasicBinArithDecoder(ByteSource &source)
+        : lo(0), hi(~0u), src(source)
+    {
+        init();
+    }
+
+    // Has the decoder read past the end of its input? If so, it's
+    // been decoding from virtual zero bytes, which means the input
+    // was truncated (or we decoded more symbols than were encoded).
+    bool overrun() const { return src.overrun(); }
+
+    // Decode a binary symbol with the probability of a 1 being "prob".
+    MINI_ARITH_FORCEINLINE int decode(uint32_t prob)
+    {
+        int bit;
+
+        // Midpoint of active probability interval subdivided via prob
+        uint32_t x = lo + scale_range<ProbBits>(hi - lo, prob);
+
+        if (code <= x)
+        {
+            hi = x;
+            bit = 1;
+        }
+        else
+        {
+            lo = x + 1;
+            bit = 0;
+        }
+
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, prob, ProbBits));
+        renorm();
+        return bit;
+    }
+
+    // Decode a bypass bit.
+    int decode_bypass()
+    {
+        int bit;
+        uint32_t x = lo + ((hi - lo) >> 1);
+
+        if (code <= x)
+        {
+            hi = x;
+            bit = 1;
+        }
+        else
+        {
+            lo = x + 1;
+            bit = 0;
+        }
+
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, kProbMax / 2));
+        renorm();
+        return bit;
+    }
+
+    // Decode "nbits" bypass bits, MSB first. Same deal as
+    // encode_bits: state in locals, no branches on the bits.
+    uint32_t decode_bits(int nbits)
+    {
+        assert(nbits >= 0 && nbits <= 16);
+        uint32_t c = code, l = lo, h = hi;
+        uint32_t value = 0;
+
+        for (int i = 0; i < nbits; ++i)
+        {
+            uint32_t x = l + ((h - l) >> 1);
+            uint32_t bit = c <= x;
+            uint32_t mask = 0 - bit;
+            h = (x & mask) | (h & ~mask);
+            l = ((x + 1) & ~mask) | (l & mask);
+            value = (value << 1) | bit;
+            MINI_ARITH_STAT(coder_stats().add_symbol(bit, kProbMax / 2));
+            MINI_ARITH_STAT(coder_stats().add_renorm(leading_zero_bytes(l ^ h)));
+
+            if ((l ^ h) < (1u << 24))
+            {
+                src.reserve(4);
+                uint8_t const *in = src.cur;
+                do
+                {
+                    c = (c << 8) | *in++;
+                    l <<= 8;
+                    h = (h << 8) | 0xff;
+                } while ((l ^ h) < (1u << 24));
+                src.cur = in;
+            }
+        }
+
+        code = c;
+        lo = l;
+        hi = h;
+        return value;
+    }
+};
+
+typedef BasicBinArithDecoder<kProbBits> BinArithDecoder;
+
+// ---- 64-bit coder
+
+// Same coder with 64-bit lo/hi, renormalizing 32 bits at a time: once
+// the top 32 bits of lo and hi agree, they go out as one 4-byte store
+// (and come back in as one 4-byte load). That's a quarter as many
+// renormalizations as the byte-wise coder, and the range is usually
+// much larger than the probability resolution, so the "straddling"
+// case (where the top bits differ but the range is tiny, costing
+// precision in the carryless scheme) is about 2^24 times rarer.
+//
+// The multiply can't be done as a single 64x64->128 bit product
+// portably, so split the range: (range >> B)*p + ((range & (2^B-1))*p >> B)
+// rounds exactly the same as the full-width product would. ProbBits
+// works the same as for BasicBinArithEncoder; with the bigger range,
+// the top end of it is where this coder is most useful.
+//
+// Not bitstream compatible with BinArithEncoder, obviously. Same
+// interface, so the models take either; see BinArithCoder below to pick
+// one with a template parameter.
+template<int ProbBits>
+inline uint64_t wide_split(uint64_t range, uint32_t prob)
+{
+    return (range >> ProbBits) * prob + (((range & ((1u << ProbBits) - 1)) * prob) >> ProbBits);
+}
+
+// Same with the resolution chosen at run time, and "slot" allowed to go
+// all the way up to 2^nbits (which gives back "range"): where the
+// multi-bit encode_bits of the 64-bit coder puts its boundaries.
+inline uint64_t wide_slot(uint64_t range, uint32_t slot, int nbits)
+{
+    return (range >> nbits) * slot + (((range & ((1ull << nbits) - 1)) * slot) >> nbits);
+}
+
+template<int ProbBits>
+class BasicBinArithEncoder64
+{
+    typedef char prob_bits_must_be_1_to_16[ProbBits >= 1 && ProbBits <= 16 ? 1 : -1];
+
+    uint64_t lo, hi;
+    bool finished;
+    VecSink vec_sink; // only used when writing to a ByteVec
+    ByteSink &sink;
+
+    // noncopyable
+    BasicBinArithEncoder64(BasicBinArithEncoder64 const &);
+    BasicBinArithEncoder64 &operator =(BasicBinArithEncoder64 const &);
+
+    // (Stats lump the 8-byte case in with 4 bytes, the last bucket.)
+    void renorm()
+    {
+        // Can happen twice in a row, so up to 8 bytes.
+        if ((lo ^ hi) < (1ull << 32))
+        {
+            sink.reserve(8);
+            uint8_t *out = sink.cur;
+            do
+            {
+                store_be32(out, (uint32_t)(lo >> 32));
+                out += 4;
+                lo <<= 32;
+                hi = (hi << 32) | 0xffffffffu;
+            } while ((lo ^ hi) < (1ull << 32));
+            MINI_ARITH_STAT(coder_stats().add_renorm(out - sink.cur));
+            sink.cur = out;
+        }
+        else
+        {
+            MINI_ARITH_STAT(coder_stats().add_renorm(0));
+        }
+    }
+
+public:
+    static int const kProbBits = ProbBits; // see BasicBinArithEncoder
+
+    explicit BasicBinArithEncoder64(ByteVec &target) : lo(0), hi(~0ull), finished(false), vec_sink(target), sink(vec_sink) { }
+    explicit BasicBinArithEncoder64(ByteSink &target) : lo(0), hi(~0ull), finished(false), sink(target) { }
+    ~BasicBinArithEncoder64() { finish(); }
+
+    void finish()
+    {
+        if (finished)
+            return;
+
+        sink.reserve(8);
+        store_be32(sink.cur, (uint32_t)(lo >> 32));
+        store_be32(sink.cur + 4, (uint32_t)lo);
+        sink.cur += 8;
+        sink.flush();
+        finished = true;
+    }
+
+    MINI_ARITH_FORCEINLINE void encode(int bit, uint32_t prob)
+    {
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, prob, ProbBits));
+        uint64_t x = lo + wide_split<ProbBits>(hi - lo, prob);
+
+        if (bit)
+            hi = x;
+        else
+            lo = x + 1;
+
+        renorm();
+    }
+
+    void encode_bypass(int bit)
+    {
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, kProbMax / 2));
+        uint64_t x = lo + ((hi - lo) >> 1);
+
+        if (bit)
+            hi = x;
+        else
+            lo = x + 1;
+
+        renorm();
+    }
+
+    // Encode the low "nbits" bits of "value" as bypass bits. With a
+    // range this wide, all of them go in as one symbol: cut the range
+    // into 2^nbits equal slots (rounded the same way as wide_split)
+    // and pick slot "value", then renormalize once. That's not the
+    // same bitstream as nbits encode_bypass() calls. Only in the rare
+    // straddling case where the range is too small for that many slots
+    // do we go bit by bit.
+    void encode_bits(uint32_t value, int nbits)
+    {
+        assert(nbits >= 0 && nbits <= 16);
+        assert(value < (1u << nbits));
+        uint64_t range = hi - lo;
+
+        if ((range >> nbits) == 0)
+        {
+            for (int i = nbits - 1; i >= 0; --i)
+                encode_bypass((value >> i) & 1);
+            return;
+        }
+
+        MINI_ARITH_STAT(for (int i = nbits - 1; i >= 0; --i) coder_stats().add_symbol((value >> i) & 1, kProbMax / 2));
+        uint64_t base = lo;
+        hi = base + wide_slot(range, value + 1, nbits);
+        lo = base + wide_slot(range, value, nbits) + (value != 0);
+        renorm();
+    }
+};
+
+typedef BasicBinArithEncoder64<kProbBits> BinArithEncoder64;
+
+template<int ProbBits>
+class BasicBinArithDecoder64
+{
+    typedef char prob_bits_must_be_1_to_16[ProbBits >= 1 && ProbBits <= 16 ? 1 : -1];
+
+    uint64_t code, lo, hi;
+    MemSource mem_source; // only used when reading from memory
+    ByteSource &src;
+
+    // noncopyable
+    BasicBinArithDecoder64(BasicBinArithDecoder64 const &);
+    BasicBinArithDecoder64 &operator =(BasicBinArithDecoder64 const &);
+
+    void renorm()
+    {
+        if ((lo ^ hi) < (1ull << 32))
+        {
+            src.reserve(8);
+            uint8_t const *in = src.cur;
+            do
+            {
+                code = (code << 32) | load_be32(in);
+                in += 4;
+                lo <<= 32;
+                hi = (hi << 32) | 0xffffffffu;
+            } while ((lo ^ hi) < (1ull << 32));
+            MINI_ARITH_STAT(coder_stats().add_renorm(in - src.cur));
+            src.cur = in;
+        }
+        else
+        {
+            MINI_ARITH_STAT(coder_stats().add_renorm(0));
+        }
+    }
+
+    void init()
+    {
+        src.reserve(8);
+        code = ((uint64_t)load_be32(src.cur) << 32) | load_be32(src.cur + 4);
+        src.cur += 8;
+    }
+
+public:
+    static int const kProbBits = ProbBits; // see BasicBinArithEncoder
+
+    explicit BasicBinArithDecoder64(ByteVec const &source)
+        : lo(0), hi(~0ull), mem_source(source.empty() ? 0 : &source[0], source.size()), src(mem_source)
+    {
+        init();
+    }
+
+    BasicBinArithDecoder64(uint8_t const *ptr, size_t size)
+        : lo(0), hi(~0ull), mem_source(ptr, size), src(mem_source)
+    {
+        init();
+    }
+
+    explicit BasicBinArithDecoder64(ByteSource &source)
+        : lo(0), hi(~0ull), src(source)
+    {
+        init();
+    }
+
+    bool overrun() const { return src.overrun(); }
+
+    MINI_ARITH_FORCEINLINE int decode(uint32_t prob)
+    {
+        int bit;
+        uint64_t x = lo + wide_split<ProbBits>(hi - lo, prob);
+
+        if (code <= x)
+        {
+            hi = x;
+            bit = 1;
+        }
+        else
+        {
+            lo = x + 1;
+            bit = 0;
+        }
+
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, prob, ProbBits));
+        renorm();
+        return bit;
+    }
+
+    int decode_bypass()
+    {
+        return decode(1u << (ProbBits - 1));
+    }
+
+    // Decode "nbits" bypass bits written by encode_bits. The slot is
+    // found by binary search over the slot boundaries, MSB first, so
+    // it's nbits multiplies but no divide and no renormalizing until
+    // the end.
+    uint32_t decode_bits(int nbits)
+    {
+        assert(nbits >= 0 && nbits <= 16);
+        uint64_t range = hi - lo;
+
+        if ((range >> nbits) == 0)
+        {
+            uint32_t value = 0;
+            for (int i = 0; i < nbits; ++i)
+                value = (value << 1) | decode_bypass();
+            return value;
+        }
+
+        // Slot v starts after wide_slot(range, v) (v > 0), so we want
+        // the largest v whose boundary is below the offset.
+        uint64_t offs = code - lo;
+        uint32_t value = 0;
+        for (int i = nbits - 1; i >= 0; --i)
+        {
+            uint32_t probe = value | (1u << i);
+            if (wide_slot(range, probe, nbits) < offs)
+                value = probe;
+        }
+
+        MINI_ARITH_STAT(for (int i = nbits - 1; i >= 0; --i) coder_stats().add_symbol((value >> i) & 1, kProbMax / 2));
+        uint64_t base = lo;
+        hi = base + wide_slot(range, value + 1, nbits);
+        lo = base + wide_slot(range, value, nbits) + (value != 0);
+        renorm();
+        return value;
+    }
+};
+
+typedef BasicBinArithDecoder64<kProbBits> BinArithDecoder64;
+
+// Pick a binary coder by state width and probability resolution:
+//   BinArithCoder<uint32_t>::Encoder is BinArithEncoder,
+//   BinArithCoder<uint64_t, 15>::Encoder is BasicBinArithEncoder64<15>,
+// and the same for Decoder.
+template<typename Word, int ProbBits = kProbBits>
+struct BinArithCoder;
+
+template<int ProbBits>
+struct BinArithCoder<uint32_t, ProbBits>
+{
+    typedef BasicBinArithEncoder<ProbBits> Encoder;
+    typedef BasicBinArithDecoder<ProbBits> Decoder;
+};
+
+template<int ProbBits>
+struct BinArithCoder<uint64_t, ProbBits>
+{
+    typedef BasicBinArithEncoder64<ProbBits> Encoder;
+    typedef BasicBinArithDecoder64<ProbBits> Decoder;
+};
+
+// ---- Batched coding
+
+// Coding one symbol at a time through a BinArithEncoder& means the
+// compiler has to keep lo/hi in memory: the output bytes get stored
+// through a uint8_t pointer, which may alias anything. For loops over
+// lots of symbols, use a batch instead. It's a copy of the coder state
+// meant to live on the stack, with the same encode() interface (so
+// models take it as their Encoder), and since its address never
+// escapes, lo/hi and the output cursor all stay in registers. The
+// destructor writes the state back to the coder; don't touch the coder
+// while a batch on it is live. Same bitstream either way.
+//
+// Batches only exist for BinArithEncoder/Decoder, so they're fixed at
+// kProbBits; a model with other ProbBits fails its static_assert on
+// them, same as on any other coder.
+class BinArithEncoderBatch
+{
+    BinArithEncoder &coder;
+    uint32_t lo, hi;
+    uint8_t *cur, *end;
+
+    // noncopyable
+    BinArithEncoderBatch(BinArithEncoderBatch const &);
+    BinArithEncoderBatch &operator =(BinArithEncoderBatch const &);
+
+    MINI_ARITH_FORCEINLINE void renorm()
+    {
+        MINI_ARITH_STAT(coder_stats().add_renorm(leading_zero_bytes(lo ^ hi)));
+
+        if ((lo ^ hi) < (1u << 24))
+        {
+            if ((size_t)(end - cur) < kMaxBytesPerSymbol)
+            {
+                ByteSink &sink = coder.sink;
+                sink.cur = cur;
+                sink.reserve(kMaxBytesPerSymbol);
+                cur = sink.cur;
+                end = sink.end;
+            }
+
+            do
+            {
+                *cur++ = lo >> 24;
+                lo <<= 8;
+                hi = (hi << 8) | 0xff;
+            } while ((lo ^ hi) < (1u << 24));
+        }
+    }
+
+public:
+    static int const kProbBits = BinArithEncoder::kProbBits; // the coder it wraps
+
+    explicit BinArithEncoderBatch(BinArithEncoder &coder)
+        : coder(coder), lo(coder.lo), hi(coder.hi), cur(coder.sink.cur), end(coder.sink.end)
+    {
+    }
+
+    ~BinArithEncoderBatch()
+    {
+        coder.lo = lo;
+        coder.hi = hi;
+        coder.sink.cur = cur;
+    }
+
+    MINI_ARITH_FORCEINLINE void encode(int bit, uint32_t prob)
+    {
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, prob));
+        uint32_t x = lo + ((uint64_t(hi - lo) * prob) >> kProbBits);
+
+        if (bit)
+            hi = x;
+        else
+            lo = x + 1;
+
+        renorm();
+    }
+
+    // Bypass bits, as in BinArithEncoder: same result as
+    // encode(bit, kProbMax / 2), minus the multiply.
+    MINI_ARITH_FORCEINLINE void encode_bypass(int bit)
+    {
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, kProbMax / 2));
+        uint32_t x = lo + ((hi - lo) >> 1);
+
+        if (bit)
+            hi = x;
+        else
+            lo = x + 1;
+
+        renorm();
+    }
+
+    // The low "nbits" bits of "value" as bypass bits, MSB first, without
+    // branching on them. Unlike BinArithEncoder's, takes up to 32 bits.
+    void encode_bits(uint32_t value, int nbits)
+    {
+        assert(nbits >= 0 && nbits <= 32);
+        for (int i = nbits - 1; i >= 0; --i)
+        {
+            uint32_t x = lo + ((hi - lo) >> 1);
+            uint32_t mask = 0 - ((value >> i) & 1);
+            hi = (x & mask) | (hi & ~mask);
+            lo = ((x + 1) & ~mask) | (lo & mask);
+            MINI_ARITH_STAT(coder_stats().add_symbol((value >> i) & 1, kProbMax / 2));
+            renorm();
+        }
+    }
+};
+
+// Same for the decoder.
+class BinArithDecoderBatch
+{
+    BinArithDecoder &coder;
+    uint32_t code, lo, hi;
+    uint8_t const *cur, *end;
+
+    // noncopyable
+    BinArithDecoderBatch(BinArithDecoderBatch const &);
+    BinArithDecoderBatch &operator =(BinArithDecoderBatch const &);
+
+    MINI_ARITH_FORCEINLINE void renorm()
+    {
+        MINI_ARITH_STAT(coder_stats().add_renorm(leading_zero_bytes(lo ^ hi)));
+
+        if ((lo ^ hi) < (1u << 24))
+        {
+            if ((size_t)(end - cur) < kMaxBytesPerSymbol)
+            {
+                ByteSource &src = coder.src;
+                src.cur = cur;
+                src.reserve(kMaxBytesPerSymbol);
+                cur = src.cur;
+                end = src.end;
+            }
+
+            do
+            {
+                code = (code << 8) | *cur++;
+                lo <<= 8;
+                hi = (hi << 8) | 0xff;
+            } while ((lo ^ hi) < (1u << 24));
+        }
+    }
+
+public:
+    static int const kProbBits = BinArithDecoder::kProbBits; // the coder it wraps
+
+    explicit BinArithDecoderBatch(BinArithDecoder &coder)
+        : coder(coder), code(coder.code), lo(coder.lo), hi(coder.hi), cur(coder.src.cur), end(coder.src.end)
+    {
+    }
+
+    ~BinArithDecoderBatch()
+    {
+        coder.code = code;
+        coder.lo = lo;
+        coder.hi = hi;
+        coder.src.cur = cur;
+    }
+
+    // Has the decoder read past the end of its input? Not for the inner
+    // loop: goes through the source's virtual overrun().
+    bool overrun() const
+    {
+        coder.src.cur = cur;
+        return coder.src.overrun();
+    }
+
+    MINI_ARITH_FORCEINLINE int decode(uint32_t prob)
+    {
+        int bit;
+        uint32_t x = lo + ((uint64_t(hi - lo) * prob) >> kProbBits);
+
+        if (code <= x)
+        {
+            hi = x;
+            bit = 1;
+        }
+        else
+        {
+            lo = x + 1;
+            bit = 0;
+        }
+
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, prob));
+        renorm();
+        return bit;
+    }
+
+    MINI_ARITH_FORCEINLINE int decode_bypass()
+    {
+        int bit;
+        uint32_t x = lo + ((hi - lo) >> 1);
+
+        if (code <= x)
+        {
+            hi = x;
+            bit = 1;
+        }
+        else
+        {
+            lo = x + 1;
+            bit = 0;
+        }
+
+        MINI_ARITH_STAT(coder_stats().add_symbol(bit, kProbMax / 2));
+        renorm();
+        return bit;
+    }
+
+    // "nbits" (up to 32) bypass bits, MSB first; see encode_bits.
+    uint32_t decode_bits(int nbits)
+    {
+        assert(nbits >= 0 && nbits <= 32);
+        uint32_t value = 0;
+        for (int i = 0; i < nbits; ++i)
+        {
+            uint32_t x = lo + ((hi - lo) >> 1);
+            uint32_t bit = code <= x;
+            uint32_t mask = 0 - bit;
+            hi = (x & mask) | (hi & ~mask);
+            lo = ((x + 1) & ~mask) | (lo & mask);
+            value = (value << 1) | bit;
+            MINI_ARITH_STAT(coder_stats().add_symbol(bit, kProbMax / 2));
+            renorm();
+        }
+        return value;
+    }
+};
+
+// ---- CPU features
+
+#ifdef MINI_ARITH_X86
+
+// For the kernels below that have x86 versions (CRC-32C, cost
+// estimation). Define MINI_ARITH_NO_SIMD to only ever use the scalar
+// ones.
+enum
+{
+    kCpuAVX2 = 1 << 1,
+    kCpuSSE42 = 1 << 2
+};
+
+inline void get_cpuid(uint32_t regs[4], uint32_t leaf, uint32_t subleaf)
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuidex(r, (int)leaf, (int)subleaf);
+    for (int i = 0; i < 4; ++i)
+        regs[i] = (uint32_t)r[i];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Which register state the OS saves on context switches.
+inline uint64_t get_xcr0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+inline uint32_t detect_cpu_features()
+{
+    uint32_t features = 0;
+    uint32_t regs[4]; // eax, ebx, ecx, edx
+    get_cpuid(regs, 0, 0);
+    uint32_t max_leaf = regs[0];
+
+    if (max_leaf >= 1)
+    {
+        get_cpuid(regs, 1, 0);
+        if (regs[2] & (1u << 20))
+            features |= kCpuSSE42;
+
+        // AVX2 needs the CPU to support it (leaf 7) and the OS to save
+        // the YMM registers (OSXSAVE + XCR0).
+        bool has_osxsave_avx = (regs[2] & (1u << 27)) && (regs[2] & (1u << 28));
+        if (has_osxsave_avx && (get_xcr0() & 6) == 6 && max_leaf >= 7)
+        {
+            get_cpuid(regs, 7, 0);
+            if (regs[1] & (1u << 5))
+                features |= kCpuAVX2;
+        }
+    }
+
+    return features;
+}
+
+inline uint32_t cpu_features()
+{
+    // cpuid is slow, only do it once.
+    static uint32_t const features = detect_cpu_features();
+    return features;
+}
+
+#endif // MINI_ARITH_X86
+
+// ---- Interleaved coders
+
+// N-way interleaved binary arithmetic coder: N independent coder
+// states ("lanes") sharing a single stream. Symbols are assigned to
+// lanes round-robin, so consecutive encode()/decode() calls don't
+// depend on each other through the coder state and the CPU can overlap
+// them. Same interface as BinArithEncoder/BinArithDecoder, so the models
+// work with either.
+//
+// The trick (same as with interleaved rANS) is for the encoder to lay
+// out the bytes in exactly the order the decoder is going to read them.
+// Every time a lane renormalizes, the decoder reads a byte for that lane;
+// but the encoder is 4 bytes ahead of the decoder: when the encoder
+// shifts out byte k of a lane, the decoder shifts in byte k+4 (it read
+// 4 bytes up front). So on every renorm, the encoder reserves a slot in
+// the output for the byte that lane will produce 4 bytes from now, and
+// writes the byte it produces right now to the slot it reserved 4 bytes
+// ago.
+//
+// That means the encoder has to go back and patch earlier output, so
+// it builds the stream in memory and hands it to the sink when done.
+//
+// N must be a power of 2. Probabilities have kProbBits bits, the lanes
+// aren't templated on it.
+template<int N>
+class InterleavedBinArithEncoder
+{
+    typedef char lane_count_must_be_pow2[(N & (N - 1)) == 0 ? 1 : -1];
+
+    uint32_t lo[N], hi[N];
+    size_t slot[N][4]; // output positions for the next 4 bytes of each lane
+    uint32_t head[N]; // oldest slot
+    int lane;
+    bool finished;
+    ByteVec buf;
+    size_t pos; // number of bytes (or slots) in buf
+    VecSink vec_sink; // only used when writing to a ByteVec
+    ByteSink &sink;
+
+    // noncopyable
+    InterleavedBinArithEncoder(InterleavedBinArithEncoder const &);
+    InterleavedBinArithEncoder &operator =(InterleavedBinArithEncoder const &);
+
+    void init()
+    {
+        for (int i = 0; i < N; ++i)
+        {
+            lo[i] = 0;
+            hi[i] = ~0u;
+            for (int j = 0; j < 4; ++j)
+                slot[i][j] = i*4 + j;
+            head[i] = 0;
+        }
+
+        lane = 0;
+        finished = false;
+        pos = N*4;
+        buf.resize(pos);
+    }
+
+    // Write the next byte for lane "i", queue up a new slot.
+    void put(int i, uint8_t byte)
+    {
+        if (buf.size() < pos + 1)
+            buf.resize(buf.size() * 2);
+
+        uint32_t h = head[i];
+        buf[slot[i][h]] = byte;
+        slot[i][h] = pos++;
+        head[i] = (h + 1) & 3;
+    }
+
+public:
+    static int const kProbBits = mini_arith::kProbBits; // see BasicBinArithEncoder
+
+    // Initialize, appending output to "target"
+    explicit InterleavedBinArithEncoder(ByteVec &target) : vec_sink(target), sink(vec_sink) { init(); }
+
+    // Initialize, writing output to "target"
+    explicit InterleavedBinArithEncoder(ByteSink &target) : sink(target) { init(); }
+
+    ~InterleavedBinArithEncoder() { finish(); }
+
+    // Finish encoding - flushes remaining codewords into their slots
+    // and writes the stream. The destructor does this if you don't.
+    void finish()
+    {
+        if (finished)
+            return;
+
+        for (int i = 0; i < N; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                uint32_t h = head[i];
+                buf[slot[i][h]] = lo[i] >> 24;
+                head[i] = (h + 1) & 3;
+                lo[i] <<= 8;
+            }
+        }
+
+        sink.write(&buf[0], pos);
+        sink.flush();
+        finished = true;
+    }
+
+    // Encode a binary symbol "bit" with the probability of a 1 being
+    // "prob", on the next lane.
+    void encode(int bit, uint32_t prob)
+    {
+        int i = lane;
+        uint32_t l = lo[i], h = hi[i];
+        uint32_t x = l + ((uint64_t(h - l) * prob) >> kProbBits);
+
+        if (bit)
+            h = x;
+        else
+            l = x + 1;
+
+        while ((l ^ h) < (1u << 24))
+        {
+            put(i, l >> 24);
+            l <<= 8;
+            h = (h << 8) | 0xff;
+        }
+
+        lo[i] = l;
+        hi[i] = h;
+        lane = (i + 1) & (N - 1);
+    }
+
+    // Encode a bypass bit on the next lane. With a constant kProbMax / 2
+    // the multiply-and-shift folds down to (h - l) >> 1.
+    void encode_bypass(int bit)
+    {
+        encode(bit, kProbMax / 2);
+    }
+
+    // Encode the low "nbits" bits of "value" as bypass bits, MSB first.
+    void encode_bits(uint32_t value, int nbits)
+    {
+        assert(nbits >= 0 && nbits <= 16);
+        for (int i = nbits - 1; i >= 0; --i)
+            encode_bypass((value >> i) & 1);
+    }
+};
+
+// Corresponding decoder.
+template<int N>
+class InterleavedBinArithDecoder
+{
+    typedef char lane_count_must_be_pow2[(N & (N - 1)) == 0 ? 1 : -1];
+
+    uint32_t code[N], lo[N], hi[N];
+    int lane;
+    MemSource mem_source; // only used when reading from memory
+    ByteSource &src;
+
+    // noncopyable
+    InterleavedBinArithDecoder(InterleavedBinArithDecoder const &);
+    InterleavedBinArithDecoder &operator =(InterleavedBinArithDecoder const &);
+
+    void init()
+    {
+        for (int i = 0; i < N; ++i)
+        {
+            src.reserve(4);
+            code[i] = 0;
+            for (int j = 0; j < 4; ++j)
+                code[i] = (code[i] << 8) | *src.cur++;
+            lo[i] = 0;
+            hi[i] = ~0u;
+        }
+
+        lane = 0;
+    }
+
+    // Renormalize lane "i"
+    void renorm(int i)
+    {
+        uint32_t c = code[i], l = lo[i], h = hi[i];
+        if ((l ^ h) < (1u << 24))
+        {
+            src.reserve(4);
+            uint8_t const *in = src.cur;
+            do
+            {
+                c = (c << 8) | *in++;
+                l <<= 8;
+                h = (h << 8) | 0xff;
+            } while ((l ^ h) < (1u << 24));
+            src.cur = in;
+        }
+        code[i] = c;
+        lo[i] = l;
+        hi[i] = h;
+    }
+
+public:
+    static int const kProbBits = mini_arith::kProbBits; // see BasicBinArithEncoder
+
+    // Start decoding from a ByteVec
+    explicit InterleavedBinArithDecoder(ByteVec const &source)
+        : mem_source(source.empty() ? 0 : &source[0], source.size()), src(mem_source)
+    {
+        init();
+    }
+
+    // Start decoding from memory, no copies
+    InterleavedBinArithDecoder(uint8_t const *ptr, size_t size)
+        : mem_source(ptr, size), src(mem_source)
+    {
+        init();
+    }
+
+    // Start decoding from an arbitrary source
+    explicit InterleavedBinArithDecoder(ByteSource &source)
+        : src(source)
+    {
+        init();
+    }
+
+    // Has the decoder read past the end of its input?
+    bool overrun() const { return src.overrun(); }
+
+    // Decode a binary symbol with the probability of a 1 being "prob",
+    // from the next lane.
+    int decode(uint32_t prob)
+    {
+        int i = lane;
+        uint32_t x = lo[i] + ((uint64_t(hi[i] - lo[i]) * prob) >> kProbBits);
+        int bit;
+
+        if (code[i] <= x)
+        {
+            hi[i] = x;
+            bit = 1;
+        }
+        else
+        {
+            lo[i] = x + 1;
+            bit = 0;
+        }
+
+        renorm(i);
+        lane = (i + 1) & (N - 1);
+        return bit;
+    }
+
+    // Decode a bypass bit from the next lane.
+    int decode_bypass()
+    {
+        return decode(kProbMax / 2);
+    }
+
+    // Decode "nbits" bypass bits, MSB first.
+    uint32_t decode_bits(int nbits)
+    {
+        assert(nbits >= 0 && nbits <= 16);
+        uint32_t value = 0;
+        for (int i = 0; i < nbits; ++i)
+            value = (value << 1) | decode_bypass();
+        return value;
+    }
+
+    // Decode one symbol on every lane at once: same result as N calls
+    // to decode() with prob[0], ..., prob[N-1], but must be called on a
+    // lane boundary (i.e. the number of symbols decoded so far is a
+    // multiple of N). bits[i] receives the i'th decoded bit.
+    //
+    // This used to have SSE4.1/AVX2/NEON kernels for the interval
+    // update. They lost to this plain loop (nearly 2x slower with 4
+    // lanes on skewed bytes, see the "lanes" codecs in the bench
+    // suite): the lanes are independent anyway, so the scalar code
+    // already overlaps them, and the SIMD version paid for gathering
+    // the probabilities in and the masks back out.
+    void decode_lanes(uint32_t const *prob, int *bits)
+    {
+        assert(lane == 0);
+        for (int i = 0; i < N; ++i)
+            bits[i] = decode(prob[i]);
+    }
+};
+
+// ---- A few basic models
+
+// NOTE: Again, this is written for clarity and ease of tinkering.
+// In practice, you will write more direct code for these once you've
+// figured out your coding structure.
+//
+// The models are templated on the coder type so they work with both
+// the plain and the interleaved coders.
+
+// Adaptive binary model. These are pretty good!
+// Lower Inertia = faster.
+//
+// You typically build more sophisticated models out of these
+// by having lots of them and choosing the active model based on
+// context.
+//
+// ProbBits is the probability resolution, which has to match the coder.
+template<int Inertia, int ProbBits = kProbBits>
+struct BinShiftModel
+{
+    static int const kProbBits = ProbBits;
+    static uint32_t const kMax = 1u << ProbBits;
+
+    uint16_t prob;
+
+    BinShiftModel() : prob(kMax / 2) {}
+
+    template<typename Encoder>
+    MINI_ARITH_FORCEINLINE void encode(Encoder &enc, int bit)
+    {
+        static_assert(Encoder::kProbBits == ProbBits, "model and coder must use the same ProbBits");
+        enc.encode(bit, prob);
+        adapt(bit);
+    }
+
+    template<typename Decoder>
+    MINI_ARITH_FORCEINLINE int decode(Decoder &dec)
+    {
+        static_assert(Decoder::kProbBits == ProbBits, "model and coder must use the same ProbBits");
+        int bit = dec.decode(prob);
+        adapt(bit);
+        return bit;
+    }
+
+    void adapt(int bit)
+    {
+        // Note prob never his 0 or kMax with this update rule!
+        if (bit)
+            prob += (kMax - prob) >> Inertia;
+        else
+            prob -= prob >> Inertia;
+    }
+};
+
+// Two-rate model: a fast and a slow adapting probability, averaged.
+// The fast half makes it warm up quickly and track changes, the slow
+// half keeps it from being too noisy once it has.
+template<int FastInertia, int SlowInertia, int ProbBits = kProbBits>
+struct BinTwoRateModel
+{
+    static int const kProbBits = ProbBits;
+    static uint32_t const kMax = 1u << ProbBits;
+
+    uint16_t fast, slow;
+
+    BinTwoRateModel() : fast(kMax / 2), slow(kMax / 2) {}
+
+    uint32_t prob() const { return (fast + slow) >> 1; }
+
+    template<typename Encoder>
+    void encode(Encoder &enc, int bit)
+    {
+        static_assert(Encoder::kProbBits == ProbBits, "model and coder must use the same ProbBits");
+        enc.encode(bit, prob());
+        adapt(bit);
+    }
+
+    template<typename Decoder>
+    int decode(Decoder &dec)
+    {
+        static_assert(Decoder::kProbBits == ProbBits, "model and coder must use the same ProbBits");
+        int bit = dec.decode(prob());
+        adapt(bit);
+        return bit;
+    }
+
+    void adapt(int bit)
+    {
+        // Same update as BinShiftModel, so neither half ever hits 0 or
+        // kMax, and neither does their average.
+        if (bit)
+        {
+            fast += (kMax - fast) >> FastInertia;
+            slow += (kMax - slow) >> SlowInertia;
+        }
+        else
+        {
+            fast -= fast >> FastInertia;
+            slow -= slow >> SlowInertia;
+        }
+    }
+};
+
+// Variable-rate model: like BinShiftModel, but the shift starts at 1
+// and grows with the number of bits seen, roughly log2(count), until it
+// reaches Inertia. Early on that's close to just counting (so the first
+// few bits move the probability a lot), later it's the usual
+// exponential decay.
+template<int Inertia, int ProbBits = kProbBits>
+struct BinVarRateModel
+{
+    typedef char inertia_must_fit_count[Inertia <= 8 ? 1 : -1];
+    static uint32_t const kMaxCount = (1u << Inertia) - 1;
+    static int const kProbBits = ProbBits;
+    static uint32_t const kMax = 1u << ProbBits;
+
+    uint16_t prob;
+    uint8_t count;
+
+    BinVarRateModel() : prob(kMax / 2), count(0) {}
+
+    template<typename Encoder>
+    void encode(Encoder &enc, int bit)
+    {
+        static_assert(Encoder::kProbBits == ProbBits, "model and coder must use the same ProbBits");
+        enc.encode(bit, prob);
+        adapt(bit);
+    }
+
+    template<typename Decoder>
+    int decode(Decoder &dec)
+    {
+        static_assert(Decoder::kProbBits == ProbBits, "model and coder must use the same ProbBits");
+        int bit = dec.decode(prob);
+        adapt(bit);
+        return bit;
+    }
+
+    void adapt(int bit)
+    {
+        if (count < kMaxCount)
+            ++count;
+
+        // shift = floor(log2(count + 1)), in [1, Inertia]
+        int shift = 31 - clz32(count + 1u);
+        if (bit)
+            prob += (kMax - prob) >> shift;
+        else
+            prob -= prob >> shift;
+    }
+};
+
+// Tables for BinStateModel: 64 probability states per MPS (most
+// probable symbol) value, as in H.264 CABAC. State i has an LPS
+// probability of 0.5 * alpha^i, with alpha chosen so the last state is
+// at 0.01875; seeing an MPS moves one state up, seeing an LPS moves to
+// the state closest to what an exponential decay update with the same
+// alpha would give. (Like in CABAC, MPS updates stop at state 62.)
+struct BinStateTables
+{
+    static int const kNumStates = 64;
+
+    uint16_t prob[kNumStates * 2]; // probability of a 1 for state byte
+    uint8_t next[2][kNumStates * 2]; // next state byte after seeing a 0/1
+
+    BinStateTables()
+    {
+        double alpha = pow(0.01875 / 0.5, 1.0 / 63);
+        double p_lps[kNumStates];
+        for (int i = 0; i < kNumStates; ++i)
+            p_lps[i] = 0.5 * pow(alpha, i);
+
+        for (int i = 0; i < kNumStates; ++i)
+        {
+            // After an LPS, the LPS probability goes up.
+            double target = alpha * p_lps[i] + (1.0 - alpha);
+            int lps_next = 0;
+            for (int j = 1; j < kNumStates; ++j)
+                if (fabs(p_lps[j] - target) < fabs(p_lps[lps_next] - target))
+                    lps_next = j;
+
+            int mps_next = i < kNumStates - 2 ? i + 1 : i;
+            uint32_t lps_prob = (uint32_t)(p_lps[i] * kProbMax + 0.5);
+            if (lps_prob < 1)
+                lps_prob = 1;
+
+            for (int mps = 0; mps < 2; ++mps)
+            {
+                int s = i*2 + mps;
+                prob[s] = (uint16_t)(mps ? kProbMax - lps_prob : lps_prob);
+                next[mps][s] = (uint8_t)(mps_next*2 + mps);
+
+                // LPS in state 0 (p=0.5) means the MPS flips.
+                if (i == 0)
+                    next[!mps][s] = (uint8_t)(lps_next*2 + !mps);
+                else
+                    next[!mps][s] = (uint8_t)(lps_next*2 + mps);
+            }
+        }
+    }
+
+    static BinStateTables const &get()
+    {
+        static BinStateTables const tables;
+        return tables;
+    }
+};
+
+// State machine model, LZMA/CABAC-style: the whole model is a single
+// byte (state index and MPS), and the probability comes out of a table.
+// Adapts fast from the start, and is as small as it gets for big
+// context tables, but the probability resolution is coarse.
+struct BinStateModel
+{
+    static int const kProbBits = mini_arith::kProbBits;
+
+    uint8_t state;
+
+    BinStateModel() : state(0) {}
+
+    template<typename Encoder>
+    void encode(Encoder &enc, int bit)
+    {
+        static_assert(Encoder::kProbBits == kProbBits, "model and coder must use the same ProbBits");
+        BinStateTables const &t = BinStateTables::get();
+        enc.encode(bit, t.prob[state]);
+        state = t.next[bit][state];
+    }
+
+    template<typename Decoder>
+    int decode(Decoder &dec)
+    {
+        static_assert(Decoder::kProbBits == kProbBits, "model and coder must use the same ProbBits");
+        BinStateTables const &t = BinStateTables::get();
+        int bit = dec.decode(t.prob[state]);
+        state = t.next[bit][state];
+        return bit;
+    }
+
+    void adapt(int bit)
+    {
+        state = BinStateTables::get().next[bit][state];
+    }
+};
+
+// Code "count" byte symbols with a bit tree model (any of the ones
+// below, or anything with the same encode/decode), in one go through a
+// batch coder (see above).
+//
+// The batch coders only come in the kProbBits flavor, so that's what
+// the model has to use.
+template<typename Model>
+inline void encode_block(Model &model, BinArithEncoder &coder, uint8_t const *syms, size_t count)
+{
+    static_assert(Model::kProbBits == BinArithEncoderBatch::kProbBits, "encode_block needs a kProbBits model");
+    BinArithEncoderBatch enc(coder);
+    for (size_t i = 0; i < count; ++i)
+        model.encode(enc, syms[i]);
+}
+
+template<typename Model>
+inline void decode_block(Model &model, BinArithDecoder &coder, uint8_t *syms, size_t count)
+{
+    static_assert(Model::kProbBits == BinArithDecoderBatch::kProbBits, "decode_block needs a kProbBits model");
+    assert(Model::kNumSyms <= 256);
+    BinArithDecoderBatch dec(coder);
+    for (size_t i = 0; i < count; ++i)
+        syms[i] = (uint8_t) model.decode(dec);
+}
+
+// BitTree model. A tree-shaped cascade of BinShiftModels.
+// This is the de-facto standard way to build a multi-symbol coder
+// (values with NumBits bits) out of binary models.
+//
+// LZMA (as in 7zip/xz) uses this type of model (backed by a BinShiftModel
+// as above) for its literals.
+template<typename BitModel, int NumBits>
+struct BitTreeModel
+{
+    static size_t const kNumSyms = 1 << NumBits;
+    static size_t const kMSB = kNumSyms / 2;
+    static int const kProbBits = BitModel::kProbBits;
+
+    BitModel model[kNumSyms - 1];
+
+    template<typename Encoder>
+    void encode(Encoder &enc, size_t value)
+    {
+        assert(value < kNumSyms);
+
+        // The first bit sent is the MSB of the value and coded without context
+        // Second bit is the bit below the MSB, using the value of the MSB as context
+        // and so forth.
+        //
+        // 1 + 2 + 4 + ... = 2^NumBits - 1 contexts.
+        // Numbering the MSB context 1 and then shifting in the coded bits from the
+        // bottom is a convenient way to index them. (So ctx is 1-based)
+        size_t ctx = 1;
+        while (ctx < kNumSyms)
+        {
+            int bit = (value & kMSB) != 0;
+            value += value; // shift value by 1 for next iter
+            MINI_ARITH_STAT(coder_stats().context = (uint32_t)ctx);
+            model[ctx - 1].encode(enc, bit);
+            ctx += ctx + bit; // shift in "bit" into context
+        }
+    }
+
+    // (Decoding two levels per step, with both candidate splits for the
+    // child computed up front, was tried and dropped: slower on text and
+    // a lot slower on skewed bytes. The branches here predict well, so
+    // the CPU already runs ahead, and each level still waits on the
+    // compare above it.)
+    template<typename Decoder>
+    size_t decode(Decoder &dec)
+    {
+        // Corresponding decoder is nice and easy:
+        size_t ctx = 1;
+        while (ctx < kNumSyms)
+        {
+            MINI_ARITH_STAT(coder_stats().context = (uint32_t)ctx);
+            ctx += ctx + model[ctx - 1].decode(dec);
+        }
+
+        return ctx - kNumSyms;
+    }
+};
+
+// Compile-time unrolled walk down a bit tree; Level counts up from 0
+// (the MSB) to NumBits, where the recursion stops.
+template<int Level, int NumBits>
+struct BitTreeUnroll
+{
+    template<typename BitModel, typename Encoder>
+    static MINI_ARITH_FORCEINLINE void encode(BitModel *model, Encoder &enc, size_t value, size_t ctx)
+    {
+        int bit = (int)(value >> (NumBits - 1 - Level)) & 1;
+        MINI_ARITH_STAT(coder_stats().context = (uint32_t)ctx);
+        model[ctx - 1].encode(enc, bit);
+        BitTreeUnroll<Level + 1, NumBits>::encode(model, enc, value, ctx*2 + bit);
+    }
+
+    template<typename BitModel, typename Decoder>
+    static MINI_ARITH_FORCEINLINE size_t decode(BitModel *model, Decoder &dec, size_t ctx)
+    {
+        MINI_ARITH_STAT(coder_stats().context = (uint32_t)ctx);
+        ctx += ctx + model[ctx - 1].decode(dec);
+        return BitTreeUnroll<Level + 1, NumBits>::decode(model, dec, ctx);
+    }
+};
+
+template<int NumBits>
+struct BitTreeUnroll<NumBits, NumBits>
+{
+    template<typename BitModel, typename Encoder>
+    static MINI_ARITH_FORCEINLINE void encode(BitModel *, Encoder &, size_t, size_t) { }
+
+    template<typename BitModel, typename Decoder>
+    static MINI_ARITH_FORCEINLINE size_t decode(BitModel *, Decoder &, size_t ctx) { return ctx; }
+};
+
+// Same as BitTreeModel (and same bitstream), but with the loop over the
+// tree levels unrolled at compile time, so the compiler sees a straight
+// line of NumBits steps, can keep ctx in a register and fold the
+// per-level array offsets. Set CheckArgs to false to skip the range
+// check on encode even in builds with asserts enabled.
+template<typename BitModel, int NumBits, bool CheckArgs = true>
+struct UnrolledBitTreeModel
+{
+    static size_t const kNumSyms = 1 << NumBits;
+    static size_t const kMSB = kNumSyms / 2;
+    static int const kProbBits = BitModel::kProbBits;
+
+    BitModel model[kNumSyms - 1];
+
+    template<typename Encoder>
+    void encode(Encoder &enc, size_t value)
+    {
+        if (CheckArgs)
+            assert(value < kNumSyms);
+
+        BitTreeUnroll<0, NumBits>::encode(model, enc, value, 1);
+    }
+
+    template<typename Decoder>
+    MINI_ARITH_FORCEINLINE size_t decode(Decoder &dec)
+    {
+        return BitTreeUnroll<0, NumBits>::decode(model, dec, 1) - kNumSyms;
+    }
+};
+
+// BitTree model with a cache-friendly layout. Instead of one flat array
+// in breadth-first order, where the deep levels are spread all over
+// memory, the tree is cut into subtrees of 4 levels each, and each of
+// those is stored together in a block of 16 slots (15 nodes plus one
+// pad). With 16-bit probabilities that's 32 bytes, so coding a
+// symbol with NumBits=8 touches exactly two 32-byte blocks. With
+// Prefetch set, we also prefetch the next block once 3 of the 4 levels
+// in the current one are done; at that point there's only two
+// candidates left, and they're adjacent (but not necessarily in the
+// same cache line, see prefetch()).
+//
+// Different node order from BitTreeModel but the same bitstream. Pairs
+// well with PackedBinShiftModel (below) if there are lots of contexts.
+template<typename BitModel, int NumBits, bool Prefetch = true>
+struct BlockedBitTreeModel
+{
+    static size_t const kNumSyms = 1 << NumBits;
+    static int const kProbBits = BitModel::kProbBits;
+    static int const kBlockLevels = 4;
+    static size_t const kBlockSlots = 1 << kBlockLevels;
+    static int const kNumGroups = (NumBits + kBlockLevels - 1) / kBlockLevels;
+
+    // Group g (levels 4g to 4g+3) has 16^g blocks.
+    static size_t const kNumBlocks = ((size_t(1) << (kNumGroups * kBlockLevels)) - 1) / (kBlockSlots - 1);
+
+    alignas(64) BitModel model[kNumBlocks * kBlockSlots];
+
+    template<typename Encoder>
+    void encode(Encoder &enc, size_t value)
+    {
+        assert(value < kNumSyms);
+        size_t base = 0; // first block in current group
+        size_t group_size = 1; // number of blocks in current group
+        size_t prefix = 0; // bits coded in previous groups
+        int level = 0;
+
+        for (;;)
+        {
+            int levels = NumBits - level < kBlockLevels ? NumBits - level : kBlockLevels;
+            bool last = level + levels == NumBits;
+            BitModel *m = model + (base + prefix) * kBlockSlots;
+            size_t ctx = 1;
+
+            for (int i = 0; i < levels; ++i)
+            {
+                int bit = (int)(value >> (NumBits - 1 - level - i)) & 1;
+                MINI_ARITH_STAT(coder_stats().context = (uint32_t)(m + ctx - model)); // slot index
+                m[ctx].encode(enc, bit);
+                ctx += ctx + bit;
+
+                if (Prefetch && !last && i == kBlockLevels - 2)
+                    prefetch(base + group_size, prefix, ctx);
+            }
+
+            if (last)
+                break;
+
+            level += levels;
+            base += group_size;
+            group_size *= kBlockSlots;
+            prefix = prefix * kBlockSlots + (ctx - kBlockSlots);
+        }
+    }
+
+    template<typename Decoder>
+    size_t decode(Decoder &dec)
+    {
+        size_t base = 0, group_size = 1, prefix = 0;
+        int level = 0;
+
+        for (;;)
+        {
+            int levels = NumBits - level < kBlockLevels ? NumBits - level : kBlockLevels;
+            bool last = level + levels == NumBits;
+            BitModel *m = model + (base + prefix) * kBlockSlots;
+            size_t ctx = 1;
+
+            for (int i = 0; i < levels; ++i)
+            {
+                MINI_ARITH_STAT(coder_stats().context = (uint32_t)(m + ctx - model));
+                ctx += ctx + m[ctx].decode(dec);
+
+                if (Prefetch && !last && i == kBlockLevels - 2)
+                    prefetch(base + group_size, prefix, ctx);
+            }
+
+            if (last)
+                return (prefix << levels) + ctx - (size_t(1) << levels);
+
+            level += levels;
+            base += group_size;
+            group_size *= kBlockSlots;
+            prefix = prefix * kBlockSlots + (ctx - kBlockSlots);
+        }
+    }
+
+private:
+    // 3 levels into a block, with the next group starting at block
+    // "next_base": prefetch the two blocks we might go to next. Groups
+    // after the first start at an odd block index, so "first" is always
+    // odd too, and with 32-byte blocks the pair straddles a 64-byte line:
+    // one prefetch per block. (When they do share a line, e.g. with
+    // smaller BitModels, the second one is a no-op.)
+    void prefetch(size_t next_base, size_t prefix, size_t ctx)
+    {
+        size_t first = next_base + prefix * kBlockSlots + (ctx - kBlockSlots / 2) * 2;
+        prefetch_mem(model + first * kBlockSlots);
+        prefetch_mem(model + (first + 1) * kBlockSlots);
+    }
+};
+
+// Adaptive binary model like BinShiftModel that packs its probability
+// into a single byte, which halves the footprint of large context
+// tables. The catch is precision: the probability is only ever 8 bits
+// (so it can't get as close to 0 or 1), and adaptation rounds up so it
+// never gets stuck. Cheaper per context, but codes a bit worse; it's a
+// trade-off worth measuring.
+template<int Inertia>
+struct PackedBinShiftModel
+{
+    static int const kProbBits = mini_arith::kProbBits;
+
+    uint8_t p8;
+
+    PackedBinShiftModel() : p8(128) {}
+
+    // Probability of a 1, with kProbBits bits. Middle of the bucket, so
+    // it's never 0 or kProbMax.
+    uint32_t prob() const { return (uint32_t(p8) << (kProbBits - 8)) + (1u << (kProbBits - 9)); }
+
+    template<typename Encoder>
+    void encode(Encoder &enc, int bit)
+    {
+        static_assert(Encoder::kProbBits == kProbBits, "model and coder must use the same ProbBits");
+        enc.encode(bit, prob());
+        adapt(bit);
+    }
+
+    template<typename Decoder>
+    int decode(Decoder &dec)
+    {
+        static_assert(Decoder::kProbBits == kProbBits, "model and coder must use the same ProbBits");
+        int bit = dec.decode(prob());
+        adapt(bit);
+        return bit;
+    }
+
+    void adapt(int bit)
+    {
+        static int const kRound = (1 << Inertia) - 1;
+        if (bit)
+            p8 += (255 - p8 + kRound) >> Inertia;
+        else
+            p8 -= (p8 + kRound) >> Inertia;
+    }
+};
+
+// ---- Context mixing
+
+// Logistic domain helpers for mixing predictions:
+//
+//   stretch(p) = ln(p / (1 - p))
+//   squash(x) = 1 / (1 + exp(-x))      (the inverse)
+//
+// Probabilities are 12 bits, the logistic domain is fixed point with
+// 8 fractional bits, clamped to [-2047, 2047].
+struct LogisticTables
+{
+    int16_t stretch[4096];
+    uint16_t squash[4096]; // indexed by x + 2048
+
+    LogisticTables()
+    {
+        for (int i = 0; i < 4096; ++i)
+        {
+            int p = (int)(4096.0 / (1.0 + exp(-(i - 2048) / 256.0)) + 0.5);
+            squash[i] = (uint16_t)(p < 1 ? 1 : p > 4095 ? 4095 : p);
+        }
+
+        // stretch(p) = smallest x with squash(x) >= p, so the two
+        // round-trip as well as they can.
+        int p = 0;
+        for (int x = -2047; x <= 2047; ++x)
+        {
+            int v = squash[x + 2048];
+            for (; p <= v; ++p)
+                stretch[p] = (int16_t)x;
+        }
+        for (; p < 4096; ++p)
+            stretch[p] = 2047;
+    }
+
+    static LogisticTables const &get()
+    {
+        static LogisticTables const tables;
+        return tables;
+    }
+
+    int squash_clamped(int x) const
+    {
+        if (x > 2047)
+            x = 2047;
+        if (x < -2047)
+            x = -2047;
+        return squash[x + 2048];
+    }
+};
+
+// Mixes a bunch of predictions in the logistic domain: the output is
+// squash(sum of w[i] * stretch(p[i])), and the weights are trained
+// online to minimize coding cost. There's a separate weight set for
+// every "select" context.
+template<int NumInputs>
+struct LogisticMixer
+{
+    std::vector<int32_t> weights; // 16.16 fixed point
+    int32_t *w; // selected weight set
+    int inputs[NumInputs]; // stretched
+    int count; // inputs added so far
+    int pr; // last prediction
+    LogisticTables const *lt;
+
+    explicit LogisticMixer(size_t num_sets)
+        : weights(num_sets * NumInputs, 65536 / 8), w(&weights[0]), count(0), pr(2048), lt(&LogisticTables::get())
+    {
+    }
+
+    void add(int st)
+    {
+        assert(count < NumInputs);
+        inputs[count++] = st;
+    }
+
+    // Mix with weight set "select"; returns a 12-bit probability.
+    int mix(size_t select)
+    {
+        assert(count == NumInputs);
+        w = &weights[select * NumInputs];
+
+        int64_t dot = 0;
+        for (int i = 0; i < NumInputs; ++i)
+            dot += (int64_t)inputs[i] * w[i];
+
+        pr = lt->squash_clamped((int)(dot >> 16));
+        return pr;
+    }
+
+    void update(int bit)
+    {
+        // Gradient step on coding cost; learning rate is 1/64.
+        int err = (bit << 12) - pr;
+        for (int i = 0; i < NumInputs; ++i)
+            w[i] += (inputs[i] * err) >> 10;
+        count = 0;
+    }
+};
+
+// Adaptive probability map (also known as secondary symbol estimation):
+// refines a probability given a context, by learning a mapping from
+// input to output probability for each context. The map is piecewise
+// linear in the logistic domain with 33 knots.
+struct AdaptiveProbMap
+{
+    static int const kRate = 7;
+
+    std::vector<uint16_t> t; // 16-bit probabilities
+    size_t index; // knot to update
+    LogisticTables const *lt;
+
+    explicit AdaptiveProbMap(size_t num_contexts)
+        : t(num_contexts * 33), index(0), lt(&LogisticTables::get())
+    {
+        // Start as the identity map.
+        for (size_t i = 0; i < num_contexts; ++i)
+            for (int j = 0; j < 33; ++j)
+                t[i*33 + j] = (uint16_t)(lt->squash_clamped((j - 16) * 128) * 16);
+    }
+
+    // Refine 12-bit probability "pr" in context "ctx".
+    int refine(int pr, size_t ctx)
+    {
+        int s = lt->stretch[pr] + 2048; // 0..4095
+        int lo = s >> 7, frac = s & 127;
+        size_t base = ctx*33 + lo;
+        index = base + (frac >> 6);
+        return (t[base] * (128 - frac) + t[base + 1] * frac) >> 11;
+    }
+
+    void update(int bit)
+    {
+        int target = (bit << 16) + (bit << kRate) - bit - bit;
+        t[index] = (uint16_t)(t[index] + ((target - t[index]) >> kRate));
+    }
+};
+
+// Context mixing byte model. Predicts every bit from
+//
+// - order 0: the bits of the current byte so far
+// - orders 1-4: hashed contexts of the previous 1-4 bytes (plus the bits
+//   so far), each a table of 2^table_bits entries
+//
+// Every context has a pair of BinShiftModels, one fast and one slow to
+// adapt; the mixer figures out which to trust when.
+//
+// mixes those with a LogisticMixer (weight set chosen by the bits so
+// far), then refines the result with an order-1 AdaptiveProbMap. The
+// output goes straight into the coder's encode/decode as "prob".
+//
+// Much better ratio than a plain order-0 BitTreeModel on text and
+// structured data, and much slower. Hash collisions just make the
+// predictions worse, they don't break anything.
+class ContextMixModel
+{
+    static int const kNumOrders = 4;
+    static int const kNumInputs = 2*(kNumOrders + 1) + 1; // two per order, plus bias
+
+    struct Counter
+    {
+        BinShiftModel<2> fast;
+        BinShiftModel<5> slow;
+
+        void adapt(int bit)
+        {
+            fast.adapt(bit);
+            slow.adapt(bit);
+        }
+    };
+
+    std::vector<Counter> order0; // 256 contexts
+    std::vector<Counter> tables[kNumOrders];
+    uint32_t table_bits;
+    uint32_t hashes[kNumOrders]; // per order, for the current byte
+    Counter *counters[kNumOrders + 1]; // in use for the current bit
+    LogisticMixer<kNumInputs> mixer;
+    AdaptiveProbMap apm;
+    LogisticTables const *lt;
+    uint32_t history; // last 4 bytes
+    uint32_t c0; // 1, followed by bits so far of the current byte
+    int pr_mix;
+
+    // Probability that the next bit is 1.
+    uint32_t predict()
+    {
+        counters[0] = &order0[c0];
+        for (int i = 0; i < kNumOrders; ++i)
+        {
+            uint32_t h = (hashes[i] + c0 * 0x5bd1e995u) * 0x9e3779b1u;
+            counters[i + 1] = &tables[i][h >> (32 - table_bits)];
+        }
+
+        for (int i = 0; i <= kNumOrders; ++i)
+        {
+            mixer.add(lt->stretch[counters[i]->fast.prob]);
+            mixer.add(lt->stretch[counters[i]->slow.prob]);
+        }
+        mixer.add(256); // bias
+
+        pr_mix = mixer.mix(c0);
+        int pr_apm = apm.refine(pr_mix, c0 | ((history & 0xff) << 8));
+        int pr = (pr_mix + 3*pr_apm) >> 2;
+
+        // The coder needs a probability strictly between 0 and 1.
+        if (pr < 1)
+            pr = 1;
+        if (pr > (int)kProbMax - 1)
+            pr = kProbMax - 1;
+        return pr;
+    }
+
+    void update(int bit)
+    {
+        for (int i = 0; i <= kNumOrders; ++i)
+            counters[i]->adapt(bit);
+        mixer.update(bit);
+        apm.update(bit);
+
+        c0 += c0 + bit;
+        if (c0 >= 256)
+        {
+            history = (history << 8) | (c0 & 0xff);
+            c0 = 1;
+            update_hashes();
+        }
+    }
+
+    void update_hashes()
+    {
+        for (int i = 0; i < kNumOrders; ++i)
+        {
+            uint32_t ctx = (i == 3) ? history : history & ((1u << (8*(i + 1))) - 1);
+            hashes[i] = (ctx + (uint32_t)i * 0x3c6ef372u) * 0x2f0f3a5bu;
+            hashes[i] ^= hashes[i] >> 15;
+        }
+    }
+
+    template<typename T>
+    static uint8_t *save_array(uint8_t *out, std::vector<T> const &v)
+    {
+        memcpy(out, &v[0], v.size() * sizeof(T));
+        return out + v.size() * sizeof(T);
+    }
+
+    template<typename T>
+    static uint8_t const *restore_array(uint8_t const *in, std::vector<T> &v)
+    {
+        memcpy((void *)&v[0], in, v.size() * sizeof(T));
+        return in + v.size() * sizeof(T);
+    }
+
+public:
+    // Context tables have 2^table_bits entries per order.
+    explicit ContextMixModel(uint32_t table_bits = 20)
+        : order0(256), table_bits(table_bits), mixer(256), apm(256 * 256),
+          lt(&LogisticTables::get()), history(0), c0(1), pr_mix(2048)
+    {
+        assert(kProbBits == 12); // mixer and APM work on 12-bit probabilities
+        assert(table_bits >= 8 && table_bits <= 30);
+        for (int i = 0; i < kNumOrders; ++i)
+            tables[i].resize((size_t)1 << table_bits);
+        update_hashes();
+    }
+
+    // Learned state (counters, mixer weights, APM), for snapshots. The
+    // byte history isn't part of it, so a restored model starts a new
+    // message from scratch.
+    size_t state_size() const
+    {
+        return (order0.size() + kNumOrders * tables[0].size()) * sizeof(Counter)
+            + mixer.weights.size() * sizeof(int32_t) + apm.t.size() * sizeof(uint16_t);
+    }
+
+    void save_state(uint8_t *out) const
+    {
+        out = save_array(out, order0);
+        for (int i = 0; i < kNumOrders; ++i)
+            out = save_array(out, tables[i]);
+        out = save_array(out, mixer.weights);
+        save_array(out, apm.t);
+    }
+
+    void restore_state(uint8_t const *in)
+    {
+        in = restore_array(in, order0);
+        for (int i = 0; i < kNumOrders; ++i)
+            in = restore_array(in, tables[i]);
+        in = restore_array(in, mixer.weights);
+        restore_array(in, apm.t);
+
+        history = 0;
+        c0 = 1;
+        update_hashes();
+    }
+
+    template<typename Encoder>
+    void encode(Encoder &enc, uint8_t value)
+    {
+        static_assert(Encoder::kProbBits == kProbBits, "model and coder must use the same ProbBits");
+        for (int i = 7; i >= 0; --i)
+        {
+            int bit = (value >> i) & 1;
+            enc.encode(bit, predict());
+            update(bit);
+        }
+    }
+
+    template<typename Decoder>
+    uint8_t decode(Decoder &dec)
+    {
+        static_assert(Decoder::kProbBits == kProbBits, "model and coder must use the same ProbBits");
+        for (int i = 0; i < 8; ++i)
+            update(dec.decode(predict()));
+
+        return (uint8_t)(history & 0xff);
+    }
+};
+
+// ---- Multi-symbol range coding
+
+// Binary coding of a byte is 8 multiplies and 8 renorm checks. A range
+// coder codes the whole symbol in one step from a cumulative frequency
+// table: sub-interval [cum, cum+freq) of a total of 2^total_bits.
+//
+// This is the carryless range coder by Dmitry Subbotin. Same idea as
+// the binary coder above: never propagate carries, and when the top
+// bytes of low and low+range agree, shift them out. The twist is what
+// happens when the range gets small (below kBot) while the top bytes
+// still differ: then we just give up the part of the interval above the
+// next kBot boundary, which makes the top bytes agree. That wastes a
+// bit of code space, but it's rare.
+static uint32_t const kRangeTop = 1u << 24;
+static uint32_t const kRangeBot = 1u << 16;
+
+class RangeEncoder
+{
+    uint32_t low, range;
+    bool finished;
+    VecSink vec_sink; // only used when writing to a ByteVec
+    ByteSink &sink;
+
+    // noncopyable
+    RangeEncoder(RangeEncoder const &);
+    RangeEncoder &operator =(RangeEncoder const &);
+
+    void renorm()
+    {
+        // Same bound as the binary coder: the range is at least 1 after
+        // encode(), and it takes at most 4 bytes out to get back to
+        // >= kRangeBot with differing top bytes.
+        sink.reserve(kMaxBytesPerSymbol);
+        uint8_t *out = sink.cur;
+        for (;;)
+        {
+            if ((low ^ (low + range)) >= kRangeTop)
+            {
+                if (range >= kRangeBot)
+                    break;
+                range = (0 - low) & (kRangeBot - 1);
+            }
+
+            *out++ = low >> 24;
+            low <<= 8;
+            range <<= 8;
+        }
+        sink.cur = out;
+    }
+
+public:
+    // Initialize, appending output to "target"
+    explicit RangeEncoder(ByteVec &target) : low(0), range(~0u), finished(false), vec_sink(target), sink(vec_sink) { }
+
+    // Initialize, writing output to "target"
+    explicit RangeEncoder(ByteSink &target) : low(0), range(~0u), finished(false), sink(target) { }
+
+    ~RangeEncoder() { finish(); }
+
+    // Finish encoding - flushes remaining codeword and the sink.
+    void finish()
+    {
+        if (finished)
+            return;
+
+        sink.reserve(4);
+        for (int i = 0; i < 4; ++i)
+        {
+            *sink.cur++ = low >> 24;
+            low <<= 8;
+        }
+        sink.flush();
+        finished = true;
+    }
+
+    // Encode the sub-interval [cum, cum+freq) out of 2^total_bits.
+    // freq must not be 0.
+    void encode(uint32_t cum, uint32_t freq, int total_bits)
+    {
+        assert(freq != 0 && cum + freq <= (1u << total_bits));
+        uint32_t r = range >> total_bits;
+        low += r * cum;
+        range = r * freq;
+        renorm();
+    }
+};
+
+// Corresponding decoder. Decoding a symbol is two steps: decode_freq()
+// returns a value in [0, 2^total_bits) that the model looks up to find
+// the symbol, then decode_update() with that symbol's interval.
+class RangeDecoder
+{
+    uint32_t code, low, range;
+    uint32_t step; // range/total from the last decode_freq()
+    MemSource mem_source; // only used when reading from memory
+    ByteSource &src;
+
+    // noncopyable
+    RangeDecoder(RangeDecoder const &);
+    RangeDecoder &operator =(RangeDecoder const &);
+
+    void renorm()
+    {
+        src.reserve(kMaxBytesPerSymbol);
+        uint8_t const *in = src.cur;
+        for (;;)
+        {
+            if ((low ^ (low + range)) >= kRangeTop)
+            {
+                if (range >= kRangeBot)
+                    break;
+                range = (0 - low) & (kRangeBot - 1);
+            }
+
+            code = (code << 8) | *in++;
+            low <<= 8;
+            range <<= 8;
+        }
+        src.cur = in;
+    }
+
+    void init()
+    {
+        src.reserve(4);
+        code = 0;
+        for (int i = 0; i < 4; ++i)
+            code = (code << 8) | *src.cur++;
+    }
+
+public:
+    // Start decoding from a ByteVec
+    explicit RangeDecoder(ByteVec const &source)
+        : low(0), range(~0u), step(0), mem_source(source.empty() ? 0 : &source[0], source.size()), src(mem_source)
+    {
+        init();
+    }
+
+    // Start decoding from memory, no copies
+    RangeDecoder(uint8_t const *ptr, size_t size)
+        : low(0), range(~0u), step(0), mem_source(ptr, size), src(mem_source)
+    {
+        init();
+    }
+
+    // Start decoding from an arbitrary source
+    explicit RangeDecoder(ByteSource &source)
+        : low(0), range(~0u), step(0), src(source)
+    {
+        init();
+    }
+
+    // Has the decoder read past the end of its input?
+    bool overrun() const { return src.overrun(); }
+
+    // Get the cumulative frequency the next symbol starts at or covers.
+    uint32_t decode_freq(int total_bits)
+    {
+        step = range >> total_bits;
+        uint32_t value = (code - low) / step;
+
+        // Can only be out of range on corrupt input; clamp so the model
+        // lookup stays in bounds.
+        uint32_t max_value = (1u << total_bits) - 1;
+        return value < max_value ? value : max_value;
+    }
+
+    // Consume the symbol with interval [cum, cum+freq); must follow
+    // decode_freq() with the same total.
+    void decode_update(uint32_t cum, uint32_t freq)
+    {
+        low += step * cum;
+        range = step * freq;
+        renorm();
+    }
+};
+
+// Adaptive frequency model for a NumSyms-symbol alphabet, to go with
+// the range coder.
+//
+// Counts get bumped for every symbol coded, but the tables the coder
+// actually uses (frequencies normalized to a power-of-2 total, plus a
+// lookup table from cumulative frequency to symbol for the decoder) are
+// only rebuilt periodically - often at first, so the model warms up
+// quickly, then every kMaxInterval symbols. Rebuilding is O(NumSyms +
+// kTotal), so that's a few operations per symbol.
+//
+// Every symbol always keeps a frequency of at least 1 so it stays
+// codeable. When the counts get large, they get halved, which keeps the
+// model adaptive.
+template<int NumSyms>
+class FreqTableModel
+{
+public:
+    static int const kTotalBits = 12;
+    static uint32_t const kTotal = 1u << kTotalBits;
+
+private:
+    static uint32_t const kIncrement = 32;
+    static uint32_t const kMaxCount = 1u << 16; // halve counts beyond
+    static uint32_t const kMaxInterval = 1024;
+
+    typedef char alphabet_must_fit[NumSyms >= 2 && NumSyms <= 256 ? 1 : -1];
+
+    uint32_t count[NumSyms];
+    uint32_t count_sum;
+    uint32_t interval, until_rebuild;
+    uint16_t cum[NumSyms + 1];
+    uint8_t lookup[kTotal]; // cumulative freq -> symbol
+
+    void update(int sym)
+    {
+        count[sym] += kIncrement;
+        count_sum += kIncrement;
+        if (--until_rebuild == 0)
+            rebuild();
+    }
+
+    void rebuild()
+    {
+        if (count_sum > kMaxCount)
+        {
+            count_sum = 0;
+            for (int i = 0; i < NumSyms; ++i)
+            {
+                count[i] = (count[i] + 1) >> 1;
+                count_sum += count[i];
+            }
+        }
+
+        // Give everyone 1, split the rest proportionally to the counts,
+        // and hand what's left over from rounding down to the most
+        // frequent symbol, where it costs the least.
+        uint32_t spread = kTotal - NumSyms;
+        uint32_t sum = 0;
+        int max_sym = 0;
+        uint32_t freq[NumSyms];
+        for (int i = 0; i < NumSyms; ++i)
+        {
+            freq[i] = 1 + (uint32_t) ((uint64_t(count[i]) * spread) / (count_sum ? count_sum : 1));
+            sum += freq[i];
+            if (count[i] > count[max_sym])
+                max_sym = i;
+        }
+        freq[max_sym] += kTotal - sum;
+
+        cum[0] = 0;
+        for (int i = 0; i < NumSyms; ++i)
+        {
+            cum[i + 1] = (uint16_t) (cum[i] + freq[i]);
+            memset(lookup + cum[i], i, freq[i]);
+        }
+
+        if (interval < kMaxInterval)
+            interval *= 2;
+        until_rebuild = interval;
+    }
+
+public:
+    FreqTableModel()
+    {
+        for (int i = 0; i < NumSyms; ++i)
+            count[i] = 0;
+        count_sum = 0;
+        interval = 8;
+        rebuild();
+    }
+
+    void encode(RangeEncoder &enc, int sym)
+    {
+        assert(sym >= 0 && sym < NumSyms);
+        enc.encode(cum[sym], cum[sym + 1] - cum[sym], kTotalBits);
+        update(sym);
+    }
+
+    int decode(RangeDecoder &dec)
+    {
+        int sym = lookup[dec.decode_freq(kTotalBits)];
+        dec.decode_update(cum[sym], cum[sym + 1] - cum[sym]);
+        update(sym);
+        return sym;
+    }
+};
+
+// ---- Resumable decoding
+
+// Binary arithmetic decoder with all state spelled out and no input
+// attached; bytes get passed in whenever the decoder wants them. That
+// means decoding can be suspended at any byte boundary of the input
+// (say, while waiting on a network read) and resumed later, possibly
+// on a different thread. The state is plain data, so it can be copied
+// or serialized as is.
+//
+// Decoding a symbol is split in two: renorm() consumes input bytes
+// until the decoder is normalized, then decode() makes the decision.
+// Nice side effect: starting from lo=hi=0, "renormalizing" reads
+// exactly the 4 initial code bytes, so start-up takes the same path.
+struct ResumableBinArithDecoder
+{
+    static int const kProbBits = mini_arith::kProbBits; // see BasicBinArithEncoder
+
+    uint32_t code, lo, hi;
+
+    void start() { code = lo = hi = 0; }
+
+    // Does the decoder need more input before the next decode()?
+    bool needs_input() const { return (lo ^ hi) < (1u << 24); }
+
+    // Consume bytes from [in, in_end) until normalized. Returns false
+    // if it runs out of input first.
+    bool renorm(uint8_t const *&in, uint8_t const *in_end)
+    {
+        while (needs_input())
+        {
+            if (in == in_end)
+                return false;
+
+            code = (code << 8) | *in++;
+            lo <<= 8;
+            hi = (hi << 8) | 0xff;
+        }
+        return true;
+    }
+
+    // Decode a binary symbol with the probability of a 1 being "prob".
+    // The decoder must be normalized.
+    int decode(uint32_t prob)
+    {
+        assert(!needs_input());
+        uint32_t x = lo + ((uint64_t(hi - lo) * prob) >> kProbBits);
+
+        if (code <= x)
+        {
+            hi = x;
+            return 1;
+        }
+        else
+        {
+            lo = x + 1;
+            return 0;
+        }
+    }
+};
+
+// Resumable decoder for a string of bytes coded with a BitTreeModel
+// (with 8 bits), the way example_multisymbol does it. This is all plain
+// data too: coder state, models, where we are in the tree and how much
+// output there is so far.
+template<typename Tree>
+struct ResumableByteDecoder
+{
+    ResumableBinArithDecoder coder;
+    Tree tree;
+    size_t ctx; // current node in the tree (1 = root)
+    size_t pos; // number of bytes decoded so far
+    size_t count; // number of bytes to decode
+    bool overrun; // read past the end of the input
+
+    // Get ready to decode "num_bytes" bytes.
+    void start(size_t num_bytes)
+    {
+        coder.start();
+        tree = Tree();
+        ctx = 1;
+        pos = 0;
+        count = num_bytes;
+        overrun = false;
+    }
+
+    bool done() const { return pos == count; }
+
+    // Continue decoding with input [in, in+in_size), writing bytes to
+    // out[pos] onwards. "last" means there's no more input after this;
+    // past the end, the decoder reads zeros and sets "overrun".
+    //
+    // Returns the number of input bytes consumed. If we're not done()
+    // afterwards, all input was consumed; call again with more.
+    size_t resume(uint8_t const *in, size_t in_size, bool last, uint8_t *out)
+    {
+        assert(Tree::kNumSyms <= 256);
+        static uint8_t const kZeros[kMaxBytesPerSymbol] = { 0 };
+        uint8_t const *cur = in, *in_end = in + in_size;
+
+        while (pos < count)
+        {
+            if (!coder.renorm(cur, in_end))
+            {
+                if (!last)
+                    break;
+
+                uint8_t const *zeros = kZeros;
+                coder.renorm(zeros, kZeros + kMaxBytesPerSymbol);
+                overrun = true;
+            }
+
+            ctx += ctx + tree.model[ctx - 1].decode(coder);
+            if (ctx >= Tree::kNumSyms)
+            {
+                out[pos++] = (uint8_t)(ctx - Tree::kNumSyms);
+                ctx = 1;
+            }
+        }
+
+        return cur - in;
+    }
+};
+
+// ---- Static rANS
+
+// For data with stable statistics, adapting the model on every bit is
+// wasted effort. This is a static order-0 backend instead: count the
+// symbols up front, store the normalized frequencies in a small header,
+// and code with rANS (two interleaved states, 32-bit state, byte-wise
+// renormalization, after ryg_rans). Decoding is one table lookup, a
+// multiply-add and a renorm check per symbol.
+//
+// rANS is LIFO: the encoder runs backwards over the data, so the
+// decoder can run forwards.
+//
+// Payload format:
+//   frequency table (see RansTable::write)
+//   u32 initial state 0, u32 initial state 1 (little endian)
+//   renormalization bytes
+
+static int const kRansScaleBits = 12;
+static uint32_t const kRansTotal = 1u << kRansScaleBits;
+static uint32_t const kRansL = 1u << 23; // lower bound of the normalized interval
+
+struct RansTable
+{
+    uint16_t freq[256];
+    uint16_t cum[257];
+
+    // Decoder table, one entry per slot: symbol in the top 8 bits,
+    // offset of the slot within the symbol's range in bits 12-23,
+    // frequency-1 in bits 0-11.
+    uint32_t slots[kRansTotal];
+
+    // Normalize a histogram with "total" symbols to frequencies summing
+    // to kRansTotal. Symbols that occur keep a frequency of at least 1.
+    void normalize(uint32_t const *hist, size_t total)
+    {
+        uint32_t sum = 0;
+        for (int i = 0; i < 256; ++i)
+        {
+            uint32_t f = 0;
+            if (hist[i])
+            {
+                f = (uint32_t) ((uint64_t(hist[i]) * kRansTotal) / total);
+                if (f == 0)
+                    f = 1;
+            }
+            freq[i] = (uint16_t) f;
+            sum += f;
+        }
+
+        // Fix up rounding errors on the most frequent symbols, where the
+        // relative change costs least.
+        while (total && sum != kRansTotal)
+        {
+            int best = -1;
+            for (int i = 0; i < 256; ++i)
+                if (freq[i] > 1 && (best < 0 || freq[i] > freq[best]))
+                    best = i;
+            if (best < 0) // only one symbol, with frequency 1
+                best = 0;
+            while (!freq[best])
+                ++best;
+
+            if (sum < kRansTotal)
+            {
+                freq[best] += (uint16_t) (kRansTotal - sum);
+                sum = kRansTotal;
+            }
+            else
+            {
+                uint32_t take = sum - kRansTotal;
+                if (take > freq[best] - 1u)
+                    take = freq[best] - 1u;
+                freq[best] -= (uint16_t) take;
+                sum -= take;
+            }
+        }
+
+        build();
+    }
+
+    // Compute cumulative frequencies and the decoder table. Returns
+    // false if the frequencies don't add up.
+    bool build()
+    {
+        cum[0] = 0;
+        for (int i = 0; i < 256; ++i)
+        {
+            if (cum[i] + freq[i] > kRansTotal)
+                return false;
+            cum[i + 1] = (uint16_t) (cum[i] + freq[i]);
+            for (uint32_t j = 0; j < freq[i]; ++j)
+                slots[cum[i] + j] = (uint32_t(i) << 24) | (j << 12) | (freq[i] - 1u);
+        }
+        return true;
+    }
+
+    // Header: 32-byte bitmap of the symbols present, then each present
+    // symbol's frequency in 1 byte (< 128) or 2 bytes (high bit set,
+    // big endian).
+    void write(ByteVec &out) const
+    {
+        for (int i = 0; i < 256; i += 8)
+        {
+            uint8_t bits = 0;
+            for (int j = 0; j < 8; ++j)
+                bits |= (freq[i + j] != 0) << j;
+            out.push_back(bits);
+        }
+
+        for (int i = 0; i < 256; ++i)
+        {
+            uint32_t f = freq[i];
+            if (!f)
+                continue;
+            if (f >= 128)
+                out.push_back((uint8_t) (0x80 | (f >> 8)));
+            out.push_back((uint8_t) f);
+        }
+    }
+
+    // Read a header written by write(). Returns the number of bytes
+    // consumed, or 0 if it's malformed.
+    size_t read(uint8_t const *data, size_t size)
+    {
+        if (size < 32)
+            return 0;
+
+        size_t pos = 32;
+        uint32_t sum = 0;
+        for (int i = 0; i < 256; ++i)
+        {
+            freq[i] = 0;
+            if (!(data[i >> 3] & (1 << (i & 7))))
+                continue;
+
+            if (pos >= size)
+                return 0;
+            uint32_t f = data[pos++];
+            if (f & 0x80)
+            {
+                if (pos >= size)
+                    return 0;
+                f = ((f & 0x7f) << 8) | data[pos++];
+            }
+            if (f == 0 || f > kRansTotal)
+                return 0;
+            freq[i] = (uint16_t) f;
+            sum += f;
+        }
+
+        // Empty table is fine (for an empty block); otherwise it has to
+        // add up exactly.
+        if (sum != 0 && sum != kRansTotal)
+            return 0;
+        if (!build())
+            return 0;
+        return pos;
+    }
+};
+
+// Encode one rANS step for "sym" on state "x", emitting renormalization
+// bytes downwards from "ptr".
+inline void rans_encode_step(uint32_t &x, uint8_t *&ptr, RansTable const &table, int sym)
+{
+    uint32_t freq = table.freq[sym];
+    uint32_t x_max = ((kRansL >> kRansScaleBits) << 8) * freq;
+    while (x >= x_max)
+    {
+        *--ptr = (uint8_t) x;
+        x >>= 8;
+    }
+    x = ((x / freq) << kRansScaleBits) + (x % freq) + table.cum[sym];
+}
+
+// Decode one rANS step from state "x". At most 2 bytes of input.
+MINI_ARITH_FORCEINLINE uint8_t rans_decode_step(uint32_t &x, uint8_t const *&ptr, RansTable const &table)
+{
+    uint32_t e = table.slots[x & (kRansTotal - 1)];
+    x = ((e & 0xfff) + 1) * (x >> kRansScaleBits) + ((e >> 12) & 0xfff);
+    while (x < kRansL)
+        x = (x << 8) | *ptr++;
+    return (uint8_t) (e >> 24);
+}
+
+// Code a buffer with a static rANS model, appending to "out".
+inline void rans_encode(ByteVec &out, uint8_t const *data, size_t size)
+{
+    uint32_t hist[256] = { 0 };
+    for (size_t i = 0; i < size; ++i)
+        hist[data[i]]++;
+
+    std::unique_ptr<RansTable> table(new RansTable);
+    table->normalize(hist, size);
+    table->write(out);
+
+    // Worst case is 2 bytes per symbol plus the final states.
+    ByteVec buf(size * 2 + 8);
+    uint8_t *ptr = &buf[0] + buf.size();
+    uint32_t x[2] = { kRansL, kRansL };
+
+    // Symbol i goes on state i&1; encode in reverse.
+    for (size_t i = size; i-- > 0; )
+        rans_encode_step(x[i & 1], ptr, *table, data[i]);
+
+    uint8_t states[8];
+    for (int i = 0; i < 8; ++i)
+        states[i] = (uint8_t) (x[i >> 2] >> ((i & 3) * 8));
+    out.insert(out.end(), states, states + 8);
+    out.insert(out.end(), ptr, &buf[0] + buf.size());
+}
+
+// Decode "out_size" bytes coded with rans_encode. Returns false if the
+// data is corrupt.
+inline bool rans_decode(uint8_t *out, size_t out_size, uint8_t const *coded, size_t coded_size)
+{
+    std::unique_ptr<RansTable> table(new RansTable);
+    size_t header = table->read(coded, coded_size);
+    if (!header || (out_size && !table->cum[256]) || coded_size - header < 8)
+        return false;
+
+    MemSource src(coded + header, coded_size - header);
+    src.reserve(8);
+    uint32_t x0 = load_le32(src.cur);
+    uint32_t x1 = load_le32(src.cur + 4);
+    src.cur += 8;
+
+    // The encoder always leaves the states in [L, 256*L); anything else
+    // is corrupt (and a state of 0 would never renormalize).
+    if (x0 < kRansL || x0 >= (kRansL << 8) || x1 < kRansL || x1 >= (kRansL << 8))
+        return false;
+
+    size_t i = 0, pairs_end = out_size & ~(size_t)1;
+    while (i < pairs_end && !src.overrun())
+    {
+        size_t end = pairs_end - i < kOverrunCheckInterval ? pairs_end : i + kOverrunCheckInterval;
+        for (; i < end; i += 2)
+        {
+            src.reserve(4);
+            out[i + 0] = rans_decode_step(x0, src.cur, *table);
+            out[i + 1] = rans_decode_step(x1, src.cur, *table);
+        }
+    }
+    if (i == pairs_end && i < out_size)
+    {
+        src.reserve(2);
+        out[i] = rans_decode_step(x0, src.cur, *table);
+        ++i;
+    }
+
+    // Decoding undoes the encoder exactly, so at the end both states
+    // must be back where the encoder started.
+    return i == out_size && x0 == kRansL && x1 == kRansL && !src.overrun();
+}
+
+// ---- Reusable coding contexts
+
+// When coding lots of small messages, setting up for each one (a fresh
+// output vector, and a model with hundreds of probabilities initialized
+// one by one in a constructor loop) can easily cost more than the
+// actual coding. A CodingContext keeps all of that around: it owns the
+// model storage and a pooled output buffer, and reset() gets the model
+// back to its initial state with a single memcpy from a copy that was
+// constructed once up front.
+//
+// Model must be trivially copyable (all the models here are: plain
+// arrays of probabilities; ContextMixModel, with its vectors, is not).
+// Memory comes from the given AllocHooks.
+template<typename Model>
+class CodingContext
+{
+    static_assert(std::is_trivially_copyable<Model>::value, "CodingContext memcpys the model, so it must be trivially copyable");
+
+    AllocHooks hooks;
+    void *mem;
+    Model *cur_model;
+    Model *init_model;
+    PoolSink out;
+
+    // noncopyable
+    CodingContext(CodingContext const &);
+    CodingContext &operator =(CodingContext const &);
+
+public:
+    explicit CodingContext(AllocHooks const &alloc_hooks = default_alloc_hooks())
+        : hooks(alloc_hooks), out(alloc_hooks)
+    {
+        // Both models in one allocation, aligned by hand since Model may
+        // ask for more alignment than the allocator guarantees.
+        size_t align = alignof(Model);
+        size_t stride = (sizeof(Model) + align - 1) & ~(align - 1);
+        mem = hooks.alloc(hooks.user, 2 * stride + align - 1);
+        if (!mem)
+            throw std::bad_alloc(); // "out" frees its own memory
+        uintptr_t base = ((uintptr_t)mem + align - 1) & ~(uintptr_t)(align - 1);
+
+        init_model = new((void *)base) Model;
+        cur_model = (Model *)(base + stride);
+        reset();
+    }
+
+    ~CodingContext()
+    {
+        hooks.free(hooks.user, mem);
+    }
+
+    // Get ready for the next message: model back to initial state,
+    // output buffer rewound.
+    void reset()
+    {
+        memcpy((void *)cur_model, init_model, sizeof(Model));
+        out.rewind();
+    }
+
+    Model &model() { return *cur_model; }
+
+    // Model state reset() goes back to; change it to start every message
+    // from a trained state (see restore_snapshot).
+    Model &initial_model() { return *init_model; }
+
+    // Output buffer, to construct an encoder on, and what was written to it.
+    ByteSink &sink() { return out; }
+    uint8_t const *data() const { return out.data(); }
+    size_t size() const { return out.size(); }
+};
+
+// ---- Multi-stream coding
+
+// With a single coder, every symbol goes through one serial chain of
+// interval updates, and decoding can't go faster than that chain. A
+// MultiStreamEncoder instead owns NumStreams independent coders, each
+// writing to its own sink; the app decides which symbols go to which
+// stream (one per model class, say: flags, literals, lengths). As long
+// as the models of one stream don't need anything decoded from another
+// stream, the streams can be decoded on different threads. Models
+// don't know or care; they're the usual ones, each used with its
+// stream's coder.
+//
+// It's not a default, and not a win for a single thread. Interleaving
+// the streams in one loop, so their dependency chains overlap, sounds
+// like it should help, but measured on example_multistream (three bit
+// trees, x86-64) it decodes about 15% slower than one serial stream:
+// most likely because three Batch coder states plus the model
+// pointers don't fit in registers, and the spills land in the chains.
+// The header and the extra flush bytes per stream cost a little size,
+// too. So use a single coder unless there are cores to spread the
+// streams over, or the app wants to decode some streams without the
+// others.
+//
+// finish() writes the streams back to back behind a small header:
+//
+//   u8  number of streams
+//   u32 size of each stream, in order (little endian)
+//   stream data
+
+template<int NumStreams>
+class MultiStreamEncoder
+{
+    typedef char num_streams_must_fit_header[NumStreams >= 1 && NumStreams <= 255 ? 1 : -1];
+
+    PoolSink sinks[NumStreams];
+    std::unique_ptr<BinArithEncoder> coders[NumStreams]; // after "sinks", so they go first
+    bool finished;
+
+    // noncopyable
+    MultiStreamEncoder(MultiStreamEncoder const &);
+    MultiStreamEncoder &operator =(MultiStreamEncoder const &);
+
+public:
+    static size_t const kHeaderSize = 1 + 4 * NumStreams;
+
+    MultiStreamEncoder() : finished(false)
+    {
+        for (int i = 0; i < NumStreams; ++i)
+            coders[i].reset(new BinArithEncoder(sinks[i]));
+    }
+
+    BinArithEncoder &stream(int i)
+    {
+        assert(i >= 0 && i < NumStreams && !finished);
+        return *coders[i];
+    }
+
+    // Finish all streams and write header plus streams to "out". No more
+    // encoding after this.
+    void finish(ByteSink &out)
+    {
+        assert(!finished);
+        for (int i = 0; i < NumStreams; ++i)
+            coders[i]->finish();
+        finished = true;
+
+        uint8_t header[kHeaderSize];
+        header[0] = (uint8_t)NumStreams;
+        for (int i = 0; i < NumStreams; ++i)
+        {
+            assert(sinks[i].size() <= 0xffffffffu);
+            uint32_t size = (uint32_t)sinks[i].size();
+            for (int j = 0; j < 4; ++j)
+                header[1 + 4*i + j] = (uint8_t)(size >> (j*8));
+        }
+
+        out.write(header, kHeaderSize);
+        for (int i = 0; i < NumStreams; ++i)
+            out.write(sinks[i].data(), sinks[i].size());
+        out.flush();
+    }
+
+    // Same, appending to a ByteVec.
+    void finish(ByteVec &out)
+    {
+        VecSink sink(out);
+        finish(sink);
+    }
+};
+
+// Corresponding decoder. The stream decoders are independent objects,
+// so different threads may use different streams at the same time.
+template<int NumStreams>
+class MultiStreamDecoder
+{
+    typedef char num_streams_must_fit_header[NumStreams >= 1 && NumStreams <= 255 ? 1 : -1];
+
+    std::unique_ptr<BinArithDecoder> coders[NumStreams];
+    bool valid;
+
+    // noncopyable
+    MultiStreamDecoder(MultiStreamDecoder const &);
+    MultiStreamDecoder &operator =(MultiStreamDecoder const &);
+
+public:
+    static size_t const kHeaderSize = MultiStreamEncoder<NumStreams>::kHeaderSize;
+
+    // If the header is malformed (wrong stream count, sizes that don't
+    // add up), ok() is false, and all streams decode from empty input.
+    MultiStreamDecoder(uint8_t const *data, size_t size)
+    {
+        valid = size >= kHeaderSize && data[0] == NumStreams;
+
+        size_t offset = kHeaderSize, sizes[NumStreams];
+        for (int i = 0; i < NumStreams && valid; ++i)
+        {
+            sizes[i] = load_le32(data + 1 + 4*i);
+            valid = sizes[i] <= size - offset;
+            offset += sizes[i];
+        }
+        valid = valid && offset == size;
+
+        offset = kHeaderSize;
+        for (int i = 0; i < NumStreams; ++i)
+        {
+            if (valid)
+            {
+                coders[i].reset(new BinArithDecoder(data + offset, sizes[i]));
+                offset += sizes[i];
+            }
+            else
+                coders[i].reset(new BinArithDecoder((uint8_t const *)0, 0));
+        }
+    }
+
+    bool ok() const { return valid; }
+
+    BinArithDecoder &stream(int i)
+    {
+        assert(i >= 0 && i < NumStreams);
+        return *coders[i];
+    }
+
+    // Did the header check out, and no stream read past its end?
+    bool overrun() const
+    {
+        bool any = !valid;
+        for (int i = 0; i < NumStreams; ++i)
+            any = any || coders[i]->overrun();
+        return any;
+    }
+};
+
+// ---- Model snapshots
+
+// Small messages compress badly with models that start from scratch.
+// Instead, train a model on a sample corpus, save its state as a
+// snapshot, and restore it before coding each message (same idea as
+// zstd dictionaries). Encoder and decoder must use the same snapshot.
+//
+// Snapshot format (little endian header):
+//   u32 magic (kSnapshotMagic)
+//   u32 format version (kSnapshotVersion)
+//   u32 model ID - chosen by the app, to tell different model types
+//       or configurations apart
+//   u32 size of the state
+//   model state, as raw host-endian memory
+//
+// Restoring is a memcpy of the state. With a CodingContext, restore
+// into initial_model() once and every reset() after that starts from
+// the trained state at no extra cost.
+
+static uint32_t const kSnapshotMagic = 0x4e53414d; // "MASN"
+static uint32_t const kSnapshotVersion = 1;
+static size_t const kSnapshotHeaderSize = 16;
+
+// How to get at a model's state. The default covers all the trivially
+// copyable models (bit models, bit trees): the state is just the object.
+template<typename Model>
+struct ModelState
+{
+    static size_t size(Model const &) { return sizeof(Model); }
+    static void save(Model const &model, uint8_t *out) { memcpy(out, (void const *)&model, sizeof(Model)); }
+    static void restore(Model &model, uint8_t const *in) { memcpy((void *)&model, in, sizeof(Model)); }
+};
+
+template<>
+struct ModelState<ContextMixModel>
+{
+    static size_t size(ContextMixModel const &model) { return model.state_size(); }
+    static void save(ContextMixModel const &model, uint8_t *out) { model.save_state(out); }
+    static void restore(ContextMixModel &model, uint8_t const *in) { model.restore_state(in); }
+};
+
+// Encoder that throws everything away. Running a model against it
+// trains the model without producing any output.
+struct NullEncoder
+{
+    static int const kProbBits = mini_arith::kProbBits; // see BasicBinArithEncoder
+
+    void encode(int, uint32_t) { }
+};
+
+// Train "model" on a sample corpus, one byte at a time.
+template<typename Model>
+inline void train_model(Model &model, uint8_t const *data, size_t size)
+{
+    NullEncoder enc;
+    for (size_t i = 0; i < size; ++i)
+        model.encode(enc, data[i]);
+}
+
+// Append a snapshot of "model" to "out".
+template<typename Model>
+inline void save_snapshot(ByteVec &out, Model const &model, uint32_t model_id)
+{
+    size_t state_size = ModelState<Model>::size(model);
+    assert(state_size <= 0xffffffffu);
+
+    put_le32(out, kSnapshotMagic);
+    put_le32(out, kSnapshotVersion);
+    put_le32(out, model_id);
+    put_le32(out, (uint32_t)state_size);
+
+    size_t pos = out.size();
+    out.resize(pos + state_size);
+    ModelState<Model>::save(model, &out[pos]);
+}
+
+// Restore "model" from a snapshot. The model must be configured like
+// the one that was saved (same type and, for ContextMixModel, the same
+// table size). Returns false, leaving the model untouched, if the
+// snapshot is malformed or for a different model.
+template<typename Model>
+inline bool restore_snapshot(Model &model, uint8_t const *data, size_t size, uint32_t model_id)
+{
+    if (size < kSnapshotHeaderSize)
+        return false;
+    if (load_le32(data) != kSnapshotMagic || load_le32(data + 4) != kSnapshotVersion)
+        return false;
+    if (load_le32(data + 8) != model_id)
+        return false;
+
+    uint32_t state_size = load_le32(data + 12);
+    if (state_size != ModelState<Model>::size(model) || state_size != size - kSnapshotHeaderSize)
+        return false;
+
+    ModelState<Model>::restore(model, data + kSnapshotHeaderSize);
+    return true;
+}
+
+// ---- Cost estimation
+
+// Picking a model (or an Inertia) per block by actually encoding the
+// block with every candidate is slow. To compare candidates we don't
+// need the bits, just how many there would be: coding a symbol that had
+// probability p costs -log2(p) bits, and the coder gets within a hair
+// of that (run a stats build and compare cost_bits against the output
+// size). That's a table lookup and an add per binary symbol - no
+// interval arithmetic, no renormalization, no output.
+//
+// Costs are fixed point with kCostFracBits fractional bits. These are
+// for kProbBits probabilities only.
+
+static int const kCostFracBits = 12;
+
+struct CostTable
+{
+    // t[p] = cost of coding a symbol that had probability p/kProbMax.
+    // p=0 can't happen with a sane model; charge it like p=1.
+    uint32_t t[kProbMax + 1];
+
+    CostTable()
+    {
+        for (uint32_t p = 1; p <= kProbMax; ++p)
+            t[p] = (uint32_t)(-log2(p / (double)kProbMax) * (1 << kCostFracBits) + 0.5);
+        t[0] = t[1];
+    }
+
+    static CostTable const &get()
+    {
+        static CostTable const table;
+        return table;
+    }
+};
+
+// Stands in for an encoder: models run against it as usual (and adapt
+// exactly as they would when really coding), but all it does is sum up
+// the costs.
+class CostEstimator
+{
+    uint32_t const *cost;
+    uint64_t total;
+
+public:
+    static int const kProbBits = mini_arith::kProbBits; // see BasicBinArithEncoder
+
+    CostEstimator() : cost(CostTable::get().t), total(0) { }
+
+    void encode(int bit, uint32_t prob) { total += cost[bit ? prob : kProbMax - prob]; }
+    void encode_bypass(int) { total += 1u << kCostFracBits; }
+    void encode_bits(uint32_t, int nbits) { total += (uint64_t)nbits << kCostFracBits; }
+
+    void reset() { total = 0; }
+
+    // Total so far, fixed point / in bits.
+    uint64_t cost_fixed() const { return total; }
+    double bits() const { return total / (double)(1u << kCostFracBits); }
+};
+
+// With CostEstimator, trying N Inertias still means N passes over the
+// data. But a BinShiftModel bit tree does exactly the same thing for
+// every Inertia except for the shift amount: same tree walk, same
+// contexts, same bits. So do them all in one pass, with the state
+// stored structure-of-arrays - for each tree node, the probabilities of
+// all candidates side by side - and the per-bit work for all candidates
+// is the same operation on adjacent values. The table lookups are a
+// gather; AVX2 has one, and the scalar kernel is still one pass.
+//
+// The estimates are exactly what CostEstimator gives for a fresh
+// BitTreeModel<BinShiftModel<Inertia>, 8> on the same data.
+
+static int const kMaxCostCandidates = 8;
+
+// Costs for each lane go into "cost" (fixed point, added to what's there).
+typedef void ShiftCostKernel(uint8_t const *data, size_t size, uint32_t const *shift, uint64_t *cost);
+
+// Flush the 32-bit per-lane sums at least this often. A bit costs at
+// most kProbBits << kCostFracBits = 49152, so 4096 bytes of 8 bits each
+// stay well below 2^32.
+static size_t const kCostFlushBytes = 4096;
+
+static_assert(uint64_t(kCostFlushBytes) * 8 * (uint32_t(kProbBits) << kCostFracBits) < (1ull << 32),
+    "per-lane cost sums would overflow");
+
+inline void shift_cost_scalar(uint8_t const *data, size_t size, uint32_t const *shift, uint64_t *cost)
+{
+    uint32_t const *t = CostTable::get().t;
+    uint32_t prob[255][kMaxCostCandidates];
+    for (int i = 0; i < 255; ++i)
+        for (int k = 0; k < kMaxCostCandidates; ++k)
+            prob[i][k] = kProbMax / 2;
+
+    for (size_t start = 0; start < size; start += kCostFlushBytes)
+    {
+        size_t end = size - start < kCostFlushBytes ? size : start + kCostFlushBytes;
+        uint32_t sum[kMaxCostCandidates] = { 0 };
+
+        for (size_t i = start; i < end; ++i)
+        {
+            uint32_t ctx = 1, value = data[i];
+            for (int j = 7; j >= 0; --j)
+            {
+                uint32_t bit = (value >> j) & 1;
+                uint32_t *p = prob[ctx - 1];
+                for (int k = 0; k < kMaxCostCandidates; ++k)
+                {
+                    uint32_t pk = p[k];
+                    if (bit)
+                    {
+                        sum[k] += t[pk];
+                        p[k] = pk + ((kProbMax - pk) >> shift[k]);
+                    }
+                    else
+                    {
+                        sum[k] += t[kProbMax - pk];
+                        p[k] = pk - (pk >> shift[k]);
+                    }
+                }
+                ctx += ctx + bit;
+            }
+        }
+
+        for (int k = 0; k < kMaxCostCandidates; ++k)
+            cost[k] += sum[k];
+    }
+}
+
+#ifdef MINI_ARITH_X86
+
+MINI_ARITH_TARGET("avx2")
+inline void shift_cost_avx2(uint8_t const *data, size_t size, uint32_t const *shift, uint64_t *cost)
+{
+    int const *t = (int const *)CostTable::get().t;
+    __m256i const kMax = _mm256_set1_epi32(kProbMax);
+    __m256i const vshift = _mm256_loadu_si256((__m256i const *)shift);
+    __m256i prob[255];
+    for (int i = 0; i < 255; ++i)
+        prob[i] = _mm256_set1_epi32(kProbMax / 2);
+
+    for (size_t start = 0; start < size; start += kCostFlushBytes)
+    {
+        size_t end = size - start < kCostFlushBytes ? size : start + kCostFlushBytes;
+        __m256i sum = _mm256_setzero_si256();
+
+        for (size_t i = start; i < end; ++i)
+        {
+            uint32_t ctx = 1, value = data[i];
+            for (int j = 7; j >= 0; --j)
+            {
+                uint32_t bit = (value >> j) & 1;
+                __m256i mask = _mm256_set1_epi32(-(int)bit);
+                __m256i p = prob[ctx - 1];
+                __m256i inv = _mm256_sub_epi32(kMax, p);
+
+                // Cost of the coded symbol; all lanes saw the same bit.
+                __m256i coded = _mm256_blendv_epi8(inv, p, mask);
+                sum = _mm256_add_epi32(sum, _mm256_i32gather_epi32(t, coded, 4));
+
+                __m256i up = _mm256_add_epi32(p, _mm256_srlv_epi32(inv, vshift));
+                __m256i down = _mm256_sub_epi32(p, _mm256_srlv_epi32(p, vshift));
+                prob[ctx - 1] = _mm256_blendv_epi8(down, up, mask);
+                ctx += ctx + bit;
+            }
+        }
+
+        uint32_t lanes[kMaxCostCandidates];
+        _mm256_storeu_si256((__m256i *)lanes, sum);
+        for (int k = 0; k < kMaxCostCandidates; ++k)
+            cost[k] += lanes[k];
+    }
+}
+
+#endif // MINI_ARITH_X86
+
+inline ShiftCostKernel *select_shift_cost_kernel()
+{
+#ifdef MINI_ARITH_X86
+    if (cpu_features() & kCpuAVX2)
+        return shift_cost_avx2;
+#endif
+    return shift_cost_scalar;
+}
+
+// Estimate the cost, in bits, of coding "data" with
+// BitTreeModel<BinShiftModel<inertias[k]>, 8>, for each of "count"
+// (at most kMaxCostCandidates) candidates. Inertias go from 1 to 11.
+inline void estimate_shift_costs(uint8_t const *data, size_t size, int const *inertias, int count, double *bits)
+{
+    assert(count >= 1 && count <= kMaxCostCandidates);
+    static ShiftCostKernel *const kernel = select_shift_cost_kernel();
+
+    // Unused lanes just run along with a copy of the first candidate.
+    uint32_t shift[kMaxCostCandidates];
+    uint64_t cost[kMaxCostCandidates] = { 0 };
+    for (int k = 0; k < kMaxCostCandidates; ++k)
+    {
+        int inertia = inertias[k < count ? k : 0];
+        assert(inertia >= 1 && inertia < kProbBits);
+        shift[k] = (uint32_t)inertia;
+    }
+
+    kernel(data, size, shift, cost);
+    for (int k = 0; k < count; ++k)
+        bits[k] = cost[k] / (double)(1u << kCostFracBits);
+}
+
+// ---- Checksums
+
+// CRC-32C (Castagnoli polynomial), to catch corrupt data. Chosen over
+// plain CRC-32 because SSE4.2 has an instruction for it that does 8
+// bytes at a time. Without that, there's a table-driven version that
+// does a byte at a time.
+
+struct Crc32cTable
+{
+    uint32_t t[256];
+
+    Crc32cTable()
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; ++j)
+                crc = (crc >> 1) ^ (0x82f63b78u & (0 - (crc & 1)));
+            t[i] = crc;
+        }
+    }
+
+    static Crc32cTable const &get()
+    {
+        static Crc32cTable const table;
+        return table;
+    }
+};
+
+// "crc" is the running value, without the pre/post inversion.
+typedef uint32_t Crc32cFunc(uint32_t crc, uint8_t const *data, size_t size);
+
+inline uint32_t crc32c_scalar(uint32_t crc, uint8_t const *data, size_t size)
+{
+    uint32_t const *t = Crc32cTable::get().t;
+    for (size_t i = 0; i < size; ++i)
+        crc = t[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef MINI_ARITH_X86
+
+MINI_ARITH_TARGET("sse4.2")
+inline uint32_t crc32c_sse42(uint32_t crc, uint8_t const *data, size_t size)
+{
+    size_t i = 0;
+#if defined(__x86_64__) || defined(_M_X64)
+    uint64_t crc64 = crc;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t x;
+        memcpy(&x, data + i, 8);
+        crc64 = _mm_crc32_u64(crc64, x);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; i < size; ++i)
+        crc = _mm_crc32_u8(crc, data[i]);
+    return crc;
+}
+
+#endif // MINI_ARITH_X86
+
+inline Crc32cFunc *select_crc32c()
+{
+#ifdef MINI_ARITH_X86
+    if (cpu_features() & kCpuSSE42)
+        return crc32c_sse42;
+#endif
+    return crc32c_scalar;
+}
+
+inline uint32_t crc32c(uint8_t const *data, size_t size)
+{
+    static Crc32cFunc *const func = select_crc32c();
+    return ~func(~0u, data, size);
+}
+
+// ---- LZ77
+
+// Everything so far codes bytes order-0, which does nothing for data
+// that repeats itself (logs, JSON, source code). This is an LZ77 stage
+// in front of the binary models, laid out much like LZMA, just smaller:
+//
+// - A hash chain match finder over a sliding window of 2^window_bits
+//   bytes: hash the next 3 bytes, walk back through earlier positions
+//   with the same hash, keep the longest match.
+// - A parser that turns the input into tokens: literals, matches
+//   (length and distance) and rep matches, which reuse the distance of
+//   the previous match. (Common in structured data, where the same
+//   record layout keeps coming around.) Greedy, with a one-step lazy
+//   check for a better match at the next byte.
+// - Binary models for the tokens: is-match and is-rep flags with the
+//   kind of the previous token as context; literals with a bit tree per
+//   top 3 bits of the previous byte; lengths with LZMA's low/mid/high
+//   bit trees; distances as a 6-bit slot (roughly 2*log2, with the
+//   match length as context) followed by the bits below the slot's top
+//   two: bypass bits, which are close to random anyway, except for the
+//   bottom kLzAlignBits, which have a bit tree of their own.
+//
+// The parser can run on its own thread, ahead of the coder, handing
+// tokens over through a ring buffer. Same output either way.
+//
+// There's no header: like with the other backends, the decoder needs
+// to be told the number of bytes. It doesn't need to know the window
+// size; distances just get checked against what's been decoded so far.
+
+static int const kLzMinWindowBits = 10;
+static int const kLzMaxWindowBits = 26;
+static uint32_t const kLzMinMatch = 2; // shortest length we can code (rep matches)
+static uint32_t const kLzHashBytes = 3; // shortest match the finder looks for
+static uint32_t const kLzMaxMatch = kLzMinMatch + 8 + 8 + 256 - 1; // 273, like LZMA
+static int const kLzHashBits = 16;
+static int const kLzAlignBits = 4; // low distance bits with a model
+
+struct LzOptions
+{
+    int window_bits; // log2 of the window size, kLzMinWindowBits..kLzMaxWindowBits
+    int max_chain; // earlier positions to check per match; more is slower and smaller
+    uint32_t nice_len; // stop looking once a match is this long
+    bool threaded; // run the parser on its own thread
+
+    LzOptions() : window_bits(22), max_chain(32), nice_len(64), threaded(false) { }
+};
+
+struct LzToken
+{
+    uint32_t len; // 0 for a literal
+    uint32_t dist; // 0 for a rep match
+};
+
+class LzMatchFinder
+{
+    uint8_t const *data;
+    size_t size;
+    uint32_t window_mask;
+    int max_chain;
+    uint32_t nice_len;
+    std::vector<uint32_t> head; // per hash: most recent position + 1, 0 = none
+    std::vector<uint32_t> chain; // per position & window_mask: previous position + 1 with the same hash
+
+    // noncopyable
+    LzMatchFinder(LzMatchFinder const &);
+    LzMatchFinder &operator =(LzMatchFinder const &);
+
+    uint32_t hash(size_t pos) const
+    {
+        uint32_t x = data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+        return (x * 2654435761u) >> (32 - kLzHashBits);
+    }
+
+public:
+    LzMatchFinder(uint8_t const *data, size_t size, LzOptions const &opts)
+        : data(data), size(size), window_mask((1u << opts.window_bits) - 1), max_chain(opts.max_chain),
+          nice_len(opts.nice_len), head(1u << kLzHashBits, 0), chain(size <= window_mask ? size + 1 : window_mask + 1, 0)
+    {
+    }
+
+    // Length of the match between "pos" and "pos - dist", at most "limit".
+    uint32_t match_len(size_t pos, size_t dist, uint32_t limit) const
+    {
+        uint8_t const *a = data + pos, *b = a - dist;
+        uint32_t len = 0;
+        while (len < limit && a[len] == b[len])
+            ++len;
+        return len;
+    }
+
+    // Most bytes a match at "pos" can have.
+    uint32_t max_len(size_t pos) const
+    {
+        return size - pos < kLzMaxMatch ? (uint32_t)(size - pos) : kLzMaxMatch;
+    }
+
+    // Add "pos" to its hash chain.
+    void insert(size_t pos)
+    {
+        if (pos + kLzHashBytes > size)
+            return;
+        uint32_t h = hash(pos);
+        chain[pos & window_mask] = head[h];
+        head[h] = (uint32_t)pos + 1;
+    }
+
+    // Longest match at "pos" (which must not be inserted yet) within
+    // the window. Returns its length, or 0 if there's none of at least
+    // kLzHashBytes, and the distance in "dist".
+    uint32_t find(size_t pos, uint32_t *dist) const
+    {
+        if (pos + kLzHashBytes > size)
+            return 0;
+
+        uint32_t limit = max_len(pos);
+        uint32_t best = kLzHashBytes - 1;
+        uint32_t cand = head[hash(pos)];
+        for (int i = 0; i < max_chain && cand; ++i)
+        {
+            size_t prev = cand - 1;
+            size_t d = pos - prev;
+
+            // Past the window, the chain slots have been reused.
+            if (d > window_mask)
+                break;
+
+            // Can't be longer than what we have unless this byte matches.
+            if (data[prev + best] == data[pos + best])
+            {
+                uint32_t len = match_len(pos, d, limit);
+                if (len > best)
+                {
+                    best = len;
+                    *dist = (uint32_t)d;
+                    if (len >= nice_len || len == limit)
+                        break;
+                }
+            }
+
+            cand = chain[prev & window_mask];
+        }
+
+        return best >= kLzHashBytes ? best : 0;
+    }
+};
+
+// Turn "data" into tokens, handing them to sink.put() in order.
+template<typename Sink>
+inline void lz_parse(uint8_t const *data, size_t size, LzOptions const &opts, Sink &sink)
+{
+    LzMatchFinder finder(data, size, opts);
+    size_t pos = 0, inserted = 0; // everything below "inserted" is in the chains
+    uint32_t rep = 0; // distance of the last match, 0 = none yet
+
+    while (pos < size)
+    {
+        uint32_t limit = finder.max_len(pos);
+        uint32_t rep_len = (rep && rep <= pos) ? finder.match_len(pos, rep, limit) : 0;
+        uint32_t dist = 0;
+        uint32_t len = finder.find(pos, &dist);
+
+        // A short match far away costs more than its literals.
+        if (len == kLzHashBytes && dist > (1u << 14))
+            len = 0;
+
+        LzToken token;
+        if (rep_len >= kLzMinMatch && rep_len + 2 >= len)
+        {
+            // Reusing the distance is much cheaper than sending a new
+            // one, so take the rep unless the new match is a lot longer.
+            token.len = rep_len;
+            token.dist = 0;
+        }
+        else if (len)
+        {
+            // Lazy matching: if the next byte starts a longer match,
+            // send this one as a literal instead.
+            if (len < opts.nice_len && pos + 1 < size)
+            {
+                if (inserted == pos)
+                    finder.insert(inserted++);
+
+                uint32_t next_dist;
+                if (finder.find(pos + 1, &next_dist) > len + 1)
+                    len = 0;
+            }
+
+            token.len = len;
+            token.dist = dist;
+            if (len)
+                rep = dist;
+        }
+        else
+        {
+            token.len = 0;
+            token.dist = 0;
+        }
+
+        sink.put(token);
+        pos += token.len ? token.len : 1;
+        for (; inserted < pos; ++inserted)
+            finder.insert(inserted);
+    }
+}
+
+// Distance slots: dist - 1 below 4 is its own slot; above, the slot is
+// twice the position of the top bit plus the bit below it. The rest
+// (slot/2 - 1 bits) goes out raw.
+inline uint32_t lz_dist_slot(uint32_t d)
+{
+    if (d < 4)
+        return d;
+    int n = 31 - clz32(d);
+    return 2 * n + ((d >> (n - 1)) & 1);
+}
+
+// Lengths kLzMinMatch..kLzMaxMatch: a flag for low (8 values) vs. more,
+// a flag for mid (8) vs. high (256), then a bit tree for the value
+// within its range. LZMA's scheme, minus the position contexts.
+struct LzLengthModel
+{
+    BinShiftModel<5> choice, choice2;
+    BitTreeModel<BinShiftModel<5>, 3> low, mid;
+    BitTreeModel<BinShiftModel<5>, 8> high;
+
+    template<typename Encoder>
+    void encode(Encoder &enc, uint32_t len)
+    {
+        uint32_t v = len - kLzMinMatch;
+        if (v < 8)
+        {
+            choice.encode(enc, 0);
+            low.encode(enc, v);
+        }
+        else if (v < 16)
+        {
+            choice.encode(enc, 1);
+            choice2.encode(enc, 0);
+            mid.encode(enc, v - 8);
+        }
+        else
+        {
+            choice.encode(enc, 1);
+            choice2.encode(enc, 1);
+            high.encode(enc, v - 16);
+        }
+    }
+
+    template<typename Decoder>
+    uint32_t decode(Decoder &dec)
+    {
+        if (!choice.decode(dec))
+            return kLzMinMatch + (uint32_t)low.decode(dec);
+        if (!choice2.decode(dec))
+            return kLzMinMatch + 8 + (uint32_t)mid.decode(dec);
+        return kLzMinMatch + 16 + (uint32_t)high.decode(dec);
+    }
+};
+
+// All the models for one LZ stream. Big-ish (about 5.5k, mostly the
+// literal trees).
+struct LzModel
+{
+    enum
+    {
+        kPrevLiteral,
+        kPrevMatch,
+        kPrevRep,
+        kNumStates
+    };
+
+    BinShiftModel<5> is_match[kNumStates];
+    BinShiftModel<5> is_rep[kNumStates];
+    BitTreeModel<BinShiftModel<5>, 8> literal[8]; // by top 3 bits of the previous byte
+    LzLengthModel match_len, rep_len;
+    BitTreeModel<BinShiftModel<5>, 6> dist_slot[4]; // by min(len - kLzMinMatch, 3)
+    BitTreeModel<BinShiftModel<6>, kLzAlignBits> dist_align; // slower: often near uniform
+    int state;
+
+    LzModel() : state(kPrevLiteral) { }
+
+    static int dist_context(uint32_t len) { return len - kLzMinMatch < 3 ? (int)(len - kLzMinMatch) : 3; }
+
+    template<typename Encoder>
+    void encode_literal(Encoder &enc, uint8_t byte, uint8_t prev)
+    {
+        is_match[state].encode(enc, 0);
+        literal[prev >> 5].encode(enc, byte);
+        state = kPrevLiteral;
+    }
+
+    template<typename Encoder>
+    void encode_rep(Encoder &enc, uint32_t len)
+    {
+        is_match[state].encode(enc, 1);
+        is_rep[state].encode(enc, 1);
+        rep_len.encode(enc, len);
+        state = kPrevRep;
+    }
+
+    template<typename Encoder>
+    void encode_match(Encoder &enc, uint32_t len, uint32_t dist)
+    {
+        is_match[state].encode(enc, 1);
+        is_rep[state].encode(enc, 0);
+        match_len.encode(enc, len);
+
+        uint32_t d = dist - 1;
+        uint32_t slot = lz_dist_slot(d);
+        dist_slot[dist_context(len)].encode(enc, slot);
+        if (slot >= 4)
+        {
+            // Low bits of the distance (up to 24 of them). The top ones
+            // are close enough to uniform to go as bypass bits, but the
+            // bottom kLzAlignBits aren't in structured data (records of
+            // 4, 8 or 16 bytes), so they get a model of their own once
+            // there are that many, like LZMA's align bits.
+            int nbits = (int)(slot >> 1) - 1;
+            uint32_t extra = d - ((2 | (slot & 1)) << nbits);
+            if (nbits < kLzAlignBits)
+                enc.encode_bits(extra, nbits);
+            else
+            {
+                enc.encode_bits(extra >> kLzAlignBits, nbits - kLzAlignBits);
+                dist_align.encode(enc, extra & ((1u << kLzAlignBits) - 1));
+            }
+        }
+        state = kPrevMatch;
+    }
+
+    // Decode a token, with the distance (dist - 1) of a new match in
+    // "d". Returns its length, 0 for a literal, or sets "is_rep".
+    template<typename Decoder>
+    uint32_t decode(Decoder &dec, uint8_t prev, uint8_t *byte, bool *is_rep_match, uint32_t *d)
+    {
+        if (!is_match[state].decode(dec))
+        {
+            *byte = (uint8_t) literal[prev >> 5].decode(dec);
+            state = kPrevLiteral;
+            return 0;
+        }
+
+        uint32_t len;
+        *is_rep_match = is_rep[state].decode(dec) != 0;
+        if (*is_rep_match)
+        {
+            len = rep_len.decode(dec);
+            state = kPrevRep;
+            return len;
+        }
+
+        len = match_len.decode(dec);
+        uint32_t slot = (uint32_t)dist_slot[dist_context(len)].decode(dec);
+        if (slot < 4)
+            *d = slot;
+        else
+        {
+            int nbits = (int)(slot >> 1) - 1;
+            uint32_t extra;
+            if (nbits < kLzAlignBits)
+                extra = dec.decode_bits(nbits);
+            else
+            {
+                extra = dec.decode_bits(nbits - kLzAlignBits) << kLzAlignBits;
+                extra |= (uint32_t)dist_align.decode(dec);
+            }
+            *d = ((2 | (slot & 1)) << nbits) + extra;
+        }
+        state = kPrevMatch;
+        return len;
+    }
+};
+
+// Token sink that codes tokens as they come.
+template<typename Encoder>
+class LzTokenWriter
+{
+    Encoder &enc;
+    LzModel &model;
+    uint8_t const *data;
+    size_t pos;
+
+    // noncopyable
+    LzTokenWriter(LzTokenWriter const &);
+    LzTokenWriter &operator =(LzTokenWriter const &);
+
+public:
+    LzTokenWriter(Encoder &enc, LzModel &model, uint8_t const *data) : enc(enc), model(model), data(data), pos(0) { }
+
+    void put(LzToken const &token)
+    {
+        if (!token.len)
+        {
+            model.encode_literal(enc, data[pos], pos ? data[pos - 1] : 0);
+            ++pos;
+            return;
+        }
+
+        if (token.dist)
+            model.encode_match(enc, token.len, token.dist);
+        else
+            model.encode_rep(enc, token.len);
+        pos += token.len;
+    }
+};
+
+// Token ring buffer from the parser thread to the coder; one producer,
+// one consumer. Both sides only publish their position every so often,
+// so there's not much cache line ping-pong.
+//
+// Exceptions can't be allowed out of the parser thread (that's
+// std::terminate), so they go through the queue too: the producer
+// hands over what it threw in finish(), and once the consumer has run
+// out of tokens, rethrow_error() throws it on the consumer's side. The
+// other way round, a consumer that bails calls cancel(), and the
+// producer throws Cancelled the next time it publishes or waits for
+// room, instead of parsing on (or waiting forever).
+class LzTokenQueue
+{
+    static size_t const kSize = 1 << 16; // tokens, power of 2
+    static size_t const kPublish = 1024; // divides kSize
+
+    std::vector<LzToken> ring;
+    std::atomic<size_t> written, read;
+    std::atomic<bool> done, cancelled;
+    std::exception_ptr error; // from the producer, valid once "done" is set
+    size_t put_pos, put_limit; // producer side
+    size_t get_pos, get_limit; // consumer side
+
+    // noncopyable
+    LzTokenQueue(LzTokenQueue const &);
+    LzTokenQueue &operator =(LzTokenQueue const &);
+
+public:
+    struct Cancelled { };
+
+    LzTokenQueue()
+        : ring(kSize), written(0), read(0), done(false), cancelled(false),
+          put_pos(0), put_limit(kSize), get_pos(0), get_limit(0)
+    {
+    }
+
+    void put(LzToken const &token)
+    {
+        if (put_pos == put_limit)
+        {
+            written.store(put_pos, std::memory_order_release);
+            while ((put_limit = read.load(std::memory_order_acquire) + kSize) == put_pos)
+            {
+                if (cancelled.load(std::memory_order_acquire))
+                    throw Cancelled();
+                std::this_thread::yield();
+            }
+        }
+
+        ring[put_pos++ & (kSize - 1)] = token;
+        if ((put_pos & (kPublish - 1)) == 0)
+        {
+            if (cancelled.load(std::memory_order_relaxed))
+                throw Cancelled();
+            written.store(put_pos, std::memory_order_release);
+        }
+    }
+
+    // Producer is done, or failed with "err".
+    void finish(std::exception_ptr err = std::exception_ptr())
+    {
+        error = err;
+        written.store(put_pos, std::memory_order_release);
+        done.store(true, std::memory_order_release);
+    }
+
+    // Consumer is giving up; stop the producer.
+    void cancel() { cancelled.store(true, std::memory_order_release); }
+
+    // After get() returned false: throw whatever the producer did.
+    void rethrow_error() const
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // Returns false once all tokens have been read.
+    bool get(LzToken *token)
+    {
+        if (get_pos == get_limit)
+        {
+            read.store(get_pos, std::memory_order_release);
+            for (;;)
+            {
+                bool finished = done.load(std::memory_order_acquire);
+                get_limit = written.load(std::memory_order_acquire);
+                if (get_limit != get_pos)
+                    break;
+                if (finished)
+                    return false;
+                std::this_thread::yield();
+            }
+        }
+
+        *token = ring[get_pos++ & (kSize - 1)];
+        if ((get_pos & (kPublish - 1)) == 0)
+            read.store(get_pos, std::memory_order_release);
+        return true;
+    }
+};
+
+inline void lz_parse_to_queue(uint8_t const *data, size_t size, LzOptions const *opts, LzTokenQueue *queue)
+{
+    try
+    {
+        lz_parse(data, size, *opts, *queue);
+    }
+    catch (...)
+    {
+        queue->finish(std::current_exception());
+        return;
+    }
+    queue->finish();
+}
+
+// LZ-code "data", appending to "out".
+inline void lz_encode(ByteVec &out, uint8_t const *data, size_t size, LzOptions const &opts)
+{
+    assert(opts.window_bits >= kLzMinWindowBits && opts.window_bits <= kLzMaxWindowBits);
+    assert(size < 0xffffffffu);
+
+    BinArithEncoder coder(out);
+    LzModel model;
+    BinArithEncoderBatch enc(coder);
+    LzTokenWriter<BinArithEncoderBatch> writer(enc, model, data);
+
+    if (!opts.threaded)
+    {
+        lz_parse(data, size, opts, writer);
+        return;
+    }
+
+    LzTokenQueue queue;
+    std::thread parser(lz_parse_to_queue, data, size, &opts, &queue);
+    try
+    {
+        LzToken token;
+        while (queue.get(&token))
+            writer.put(token);
+    }
+    catch (...)
+    {
+        queue.cancel();
+        parser.join();
+        throw;
+    }
+    parser.join();
+    queue.rethrow_error();
+}
+
+inline void lz_encode(ByteVec &out, uint8_t const *data, size_t size)
+{
+    lz_encode(out, data, size, LzOptions());
+}
+
+// Decode "out_size" bytes. Returns false on corrupt or truncated input.
+inline bool lz_decode(uint8_t *out, size_t out_size, uint8_t const *coded, size_t coded_size)
+{
+    BinArithDecoder coder(coded, coded_size);
+    LzModel model;
+    {
+        BinArithDecoderBatch dec(coder);
+        size_t pos = 0, tokens = 0;
+        uint64_t rep = 0;
+
+        while (pos < out_size)
+        {
+            if ((++tokens & (kOverrunCheckInterval - 1)) == 0 && dec.overrun())
+                return false;
+
+            uint8_t byte = 0;
+            bool is_rep = false;
+            uint32_t d = 0;
+            uint32_t len = model.decode(dec, pos ? out[pos - 1] : 0, &byte, &is_rep, &d);
+            if (!len)
+            {
+                out[pos++] = byte;
+                continue;
+            }
+
+            if (!is_rep)
+                rep = (uint64_t)d + 1;
+            if (!rep || rep > pos || len > out_size - pos)
+                return false;
+
+            // Byte at a time: the source may overlap what we're writing.
+            uint8_t const *src = out + pos - (size_t)rep;
+            for (uint32_t i = 0; i < len; ++i)
+                out[pos + i] = src[i];
+            pos += len;
+        }
+    }
+
+    return !coder.overrun();
+}
+
+// ---- Block-parallel compression
+
+// For large buffers, split the input into independent blocks, each
+// coded with a fresh model and coder. Blocks can then be encoded and
+// decoded in parallel, and any one block can be decoded without touching
+// the others. Smaller blocks scale better; larger blocks give the models
+// more time to adapt and compress better.
+//
+// Container format (all little endian):
+//   header:
+//     u32 magic (kContainerMagic)
+//     u32 format version (kContainerVersion)
+//     u32 block size
+//     u32 model ID of the adaptive backend (kBlockModelId)
+//   coded blocks, back to back
+//   seek table, one entry per block:
+//     u32 coded size
+//     u32 CRC-32C of the uncompressed block
+//   footer:
+//     u64 raw (uncompressed) size
+//     u32 number of blocks
+//     u32 CRC-32C of the seek table and the two fields above
+//     u32 magic (kContainerMagic)
+//
+// The seek table goes at the end, so a writer can send blocks off as
+// they're done and doesn't need to know the sizes up front. A reader
+// looks at the fixed-size footer first, which says where the seek
+// table is, and from there it can go straight to any block.
+//
+// Each coded block starts with a byte saying which backend it uses
+// (see BlockBackend), followed by that backend's payload.
+
+typedef UnrolledBitTreeModel<BinShiftModel<5>, 8, false> BlockByteModel;
+
+static uint32_t const kContainerMagic = 0x4352414d; // "MARC"
+static uint32_t const kContainerVersion = 1;
+static uint32_t const kBlockModelId = 0x55540805; // "UT", 8 bits, shift 5
+static size_t const kContainerHeaderSize = 16;
+static size_t const kContainerFooterSize = 20;
+static size_t const kSeekEntrySize = 8;
+
+// Largest block size the format allows. Decoding needs a buffer that
+// big for any one block, and the block size comes straight from the
+// header; capping it caps what a forged header can make us allocate.
+static size_t const kMaxBlockSize = 1 << 26; // 64 MB
+
+// max_output when the caller doesn't pass one.
+static uint64_t const kDefaultMaxOutput = (uint64_t)1 << 32; // 4 GB
+
+enum BlockBackend
+{
+    kBackendArith = 0, // adaptive order-0 bit tree
+    kBackendRans = 1, // static order-0 rANS
+    kBackendLz = 2, // LZ77 with binary models, default LzOptions
+    kBackendAuto = 255 // pick per block (encoder only; arith or rans)
+};
+
+// Why decompressing failed. Everything that can go wrong with untrusted
+// input ends up as one of these; nothing is undefined behavior, and
+// nothing gets allocated based on what the header claims alone: output
+// buffers grow a batch of blocks at a time as blocks actually decode,
+// and a batch is at most kDecodeBatchBytes (or one block per thread).
+enum DecodeStatus
+{
+    kDecodeOk = 0,
+    kDecodeTruncated, // too short to even have a header and a footer
+    kDecodeBadHeader, // not a container, unsupported version, or bad seek table
+    kDecodeTooLarge, // output would be larger than max_output
+    kDecodeCorrupt, // a block didn't decode
+    kDecodeBadChecksum, // a block decoded, but to the wrong data
+    kDecodeOutOfMemory
+};
+
+inline char const *decode_status_name(DecodeStatus status)
+{
+    switch (status)
+    {
+    case kDecodeOk:          return "ok";
+    case kDecodeTruncated:   return "truncated input";
+    case kDecodeBadHeader:   return "bad header or seek table";
+    case kDecodeTooLarge:    return "output too large";
+    case kDecodeCorrupt:     return "corrupt block";
+    case kDecodeBadChecksum: return "checksum mismatch";
+    case kDecodeOutOfMemory: return "out of memory";
+    }
+    return "unknown error";
+}
+
+// In auto mode, rANS wins unless it's more than 1/kRansSlack larger:
+// it decodes several times faster, which is worth a few percent.
+static size_t const kRansSlack = 32;
+
+inline uint64_t load_le64(uint8_t const *p)
+{
+    return load_le32(p) | ((uint64_t)load_le32(p + 4) << 32);
+}
+
+// Parsed header, footer and seek table.
+struct BlockIndex
+{
+    uint64_t raw_size;
+    uint32_t block_size;
+    std::vector<size_t> offsets; // start of each coded block, plus end of last
+    std::vector<uint32_t> checksums; // CRC-32C of each raw block
+
+    size_t num_blocks() const { return checksums.size(); }
+
+    // Raw offset and size of block "i".
+    size_t raw_begin(size_t i) const { return i * block_size; }
+    size_t raw_len(size_t i) const
+    {
+        uint64_t rest = raw_size - raw_begin(i);
+        return rest < block_size ? (size_t)rest : block_size;
+    }
+
+    // Read the container structure. Only looks at the header, footer
+    // and seek table, not the blocks.
+    DecodeStatus parse(uint8_t const *data, size_t size)
+    {
+        if (size < kContainerHeaderSize + kContainerFooterSize)
+            return kDecodeTruncated;
+        if (load_le32(data) != kContainerMagic || load_le32(data + 4) != kContainerVersion)
+            return kDecodeBadHeader;
+        if (load_le32(data + 12) != kBlockModelId)
+            return kDecodeBadHeader;
+
+        uint8_t const *footer = data + size - kContainerFooterSize;
+        if (load_le32(footer + 16) != kContainerMagic)
+            return kDecodeBadHeader;
+
+        block_size = load_le32(data + 8);
+        raw_size = load_le64(footer);
+        uint32_t count = load_le32(footer + 8);
+
+        if (block_size == 0 || block_size > kMaxBlockSize || raw_size > SIZE_MAX)
+            return kDecodeBadHeader;
+        if (count != (raw_size + block_size - 1) / block_size)
+            return kDecodeBadHeader;
+        if (count > (size - kContainerHeaderSize - kContainerFooterSize) / kSeekEntrySize)
+            return kDecodeBadHeader;
+
+        size_t table_size = count * kSeekEntrySize;
+        uint8_t const *table = footer - table_size;
+        if (crc32c(table, table_size + 12) != load_le32(footer + 12))
+            return kDecodeBadHeader;
+
+        offsets.resize(count + 1);
+        checksums.resize(count);
+        size_t pos = kContainerHeaderSize;
+        size_t blocks_end = table - data;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            offsets[i] = pos;
+            pos += load_le32(table + i*kSeekEntrySize);
+            checksums[i] = load_le32(table + i*kSeekEntrySize + 4);
+            if (pos > blocks_end)
+                return kDecodeBadHeader;
+        }
+        offsets[count] = pos;
+        return pos == blocks_end ? kDecodeOk : kDecodeBadHeader;
+    }
+
+    // Biggest raw block; what a buffer for any one block needs. (Not
+    // block_size, which comes straight from the header and can be made
+    // up to claim anything.)
+    size_t max_raw_len() const { return raw_size < block_size ? (size_t)raw_size : block_size; }
+};
+
+// Number of threads to use for "threads" (0 = one per core).
+inline int resolve_threads(int threads)
+{
+    if (threads <= 0)
+        threads = (int)std::thread::hardware_concurrency();
+    return threads > 0 ? threads : 1;
+}
+
+// Call job(i) for all i in [0, count), spread over up to "threads"
+// threads (0 = one per core). Workers grab the next index off a shared
+// counter, so uneven jobs balance out.
+template<typename Job>
+inline void parallel_for(size_t count, int threads, Job const &job)
+{
+    threads = resolve_threads(threads);
+    if ((size_t)threads > count)
+        threads = (int)count;
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]()
+    {
+        for (;;)
+        {
+            size_t i = next++;
+            if (i >= count)
+                break;
+            job(i);
+        }
+    };
+
+    // The calling thread does its share too.
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; ++i)
+        pool.push_back(std::thread(worker));
+    worker();
+    for (size_t i = 0; i < pool.size(); ++i)
+        pool[i].join();
+}
+
+// Code a buffer with a fresh adaptive model, appending to "out".
+inline void arith_encode(ByteVec &out, uint8_t const *data, size_t size)
+{
+    BinArithEncoder coder(out);
+    BlockByteModel model;
+    for (size_t i = 0; i < size; ++i)
+        model.encode(coder, data[i]);
+}
+
+inline bool arith_decode(uint8_t *out, size_t out_size, uint8_t const *coded, size_t coded_size)
+{
+    BinArithDecoder coder(coded, coded_size);
+    BlockByteModel model;
+    for (size_t start = 0; start < out_size && !coder.overrun(); start += kOverrunCheckInterval)
+    {
+        size_t end = out_size - start < kOverrunCheckInterval ? out_size : start + kOverrunCheckInterval;
+        for (size_t i = start; i < end; ++i)
+            out[i] = (uint8_t) model.decode(coder);
+    }
+
+    return !coder.overrun();
+}
+
+// Code a single block with the given backend.
+inline void encode_block(ByteVec &out, uint8_t const *data, size_t size, BlockBackend backend)
+{
+    if (backend == kBackendAuto)
+    {
+        // Arith goes straight to "out"; rANS to a scratch buffer that
+        // stays around (per thread), so a long run of blocks doesn't
+        // reallocate it every time. Copy that over if it wins.
+        static thread_local ByteVec rans;
+        size_t start = out.size();
+        out.push_back((uint8_t) kBackendArith);
+        arith_encode(out, data, size);
+        rans.clear();
+        rans_encode(rans, data, size);
+
+        size_t arith_size = out.size() - start - 1;
+        if (rans.size() <= arith_size + arith_size / kRansSlack)
+        {
+            out.resize(start);
+            out.push_back((uint8_t) kBackendRans);
+            out.insert(out.end(), rans.begin(), rans.end());
+        }
+        return;
+    }
+
+    out.push_back((uint8_t) backend);
+    if (backend == kBackendRans)
+        rans_encode(out, data, size);
+    else if (backend == kBackendLz)
+        lz_encode(out, data, size);
+    else
+        arith_encode(out, data, size);
+}
+
+inline bool decode_block(uint8_t *out, size_t out_size, uint8_t const *coded, size_t coded_size)
+{
+    if (coded_size < 1)
+        return false;
+
+    switch (coded[0])
+    {
+    case kBackendArith: return arith_decode(out, out_size, coded + 1, coded_size - 1);
+    case kBackendRans:  return rans_decode(out, out_size, coded + 1, coded_size - 1);
+    case kBackendLz:    return lz_decode(out, out_size, coded + 1, coded_size - 1);
+    default:            return false;
+    }
+}
+
+// Decode block "i" of a parsed container at "data" into "out" and
+// check it against its checksum.
+inline DecodeStatus decode_indexed_block(uint8_t *out, BlockIndex const &index, uint8_t const *data, size_t i)
+{
+    size_t coded_begin = index.offsets[i];
+    size_t coded_size = index.offsets[i + 1] - coded_begin;
+    size_t len = index.raw_len(i);
+
+    try
+    {
+        if (!decode_block(out, len, data + coded_begin, coded_size))
+            return kDecodeCorrupt;
+    }
+    catch (std::bad_alloc const &)
+    {
+        return kDecodeOutOfMemory;
+    }
+    return crc32c(out, len) == index.checksums[i] ? kDecodeOk : kDecodeBadChecksum;
+}
+
+// First error reported by any of the workers. Once there is one, the
+// others skip their remaining blocks.
+class DecodeStatusFlag
+{
+    std::atomic<int> status;
+
+public:
+    DecodeStatusFlag() : status(kDecodeOk) { }
+
+    bool failed() const { return status.load(std::memory_order_relaxed) != kDecodeOk; }
+    DecodeStatus get() const { return (DecodeStatus)status.load(); }
+
+    void report(DecodeStatus result)
+    {
+        int expected = kDecodeOk;
+        if (result != kDecodeOk)
+            status.compare_exchange_strong(expected, result);
+    }
+};
+
+// Writes a container to a sink, a batch of blocks at a time: each batch
+// gets coded in parallel, then written out in order. That keeps memory
+// use bounded no matter how large the input is, and since the seek
+// table goes at the end, nothing needs to be known up front.
+class ContainerWriter
+{
+    ByteSink &sink;
+    size_t block_size;
+    int threads;
+    BlockBackend backend;
+    uint64_t raw_size;
+    bool saw_partial; // had a partial block, which must be the last one
+    ByteVec table; // seek table so far
+    std::vector<ByteVec> coded; // per block in the current batch
+    std::vector<uint32_t> checksums;
+
+    // noncopyable
+    ContainerWriter(ContainerWriter const &);
+    ContainerWriter &operator =(ContainerWriter const &);
+
+    void write_u32(uint32_t x)
+    {
+        uint8_t buf[4];
+        for (int i = 0; i < 4; ++i)
+            buf[i] = (uint8_t)(x >> (i*8));
+        sink.write(buf, 4);
+    }
+
+    void write_header()
+    {
+        write_u32(kContainerMagic);
+        write_u32(kContainerVersion);
+        write_u32((uint32_t)block_size);
+        write_u32(kBlockModelId);
+    }
+
+public:
+    ContainerWriter(ByteSink &target, size_t block_size, int threads, BlockBackend backend = kBackendAuto)
+        : sink(target), block_size(block_size), threads(resolve_threads(threads)), backend(backend),
+          raw_size(0), saw_partial(false)
+    {
+        assert(block_size > 0 && block_size <= kMaxBlockSize);
+        write_header();
+    }
+
+    // Start another container on the same sink, after finish(). The
+    // buffers from last time get reused, so a long-lived writer coding
+    // one buffer after another doesn't keep going back to the heap.
+    void restart()
+    {
+        raw_size = 0;
+        saw_partial = false;
+        table.clear();
+        write_header();
+    }
+
+    // Blocks per batch; add_data() is most efficient with multiples
+    // of batch_bytes().
+    size_t batch_blocks() const { return (size_t)threads * 4; }
+    size_t batch_bytes() const { return batch_blocks() * block_size; }
+
+    // Code and write "size" more bytes. Every call but the last must
+    // pass a multiple of the block size.
+    void add_data(uint8_t const *data, size_t size)
+    {
+        assert(!saw_partial);
+        size_t num_blocks = (size + block_size - 1) / block_size;
+        saw_partial = (size % block_size) != 0;
+
+        for (size_t first = 0; first < num_blocks; first += batch_blocks())
+        {
+            size_t count = num_blocks - first < batch_blocks() ? num_blocks - first : batch_blocks();
+            coded.resize(count);
+            checksums.resize(count);
+
+            parallel_for(count, threads, [&](size_t i)
+            {
+                size_t begin = (first + i) * block_size;
+                size_t len = size - begin < block_size ? size - begin : block_size;
+                coded[i].clear();
+                encode_block(coded[i], data + begin, len, backend);
+                checksums[i] = crc32c(data + begin, len);
+            });
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                sink.write(coded[i].empty() ? 0 : &coded[i][0], coded[i].size());
+                put_le32(table, (uint32_t)coded[i].size());
+                put_le32(table, checksums[i]);
+            }
+        }
+
+        raw_size += size;
+    }
+
+    // Write the seek table and footer, and flush the sink.
+    void finish()
+    {
+        size_t num_blocks = table.size() / kSeekEntrySize;
+        assert(num_blocks <= 0xffffffffu);
+        put_le32(table, (uint32_t)raw_size);
+        put_le32(table, (uint32_t)(raw_size >> 32));
+        put_le32(table, (uint32_t)num_blocks);
+        uint32_t crc = crc32c(&table[0], table.size());
+        put_le32(table, crc);
+        put_le32(table, kContainerMagic);
+
+        sink.write(&table[0], table.size());
+        sink.flush();
+    }
+};
+
+// Compress "size" bytes at "data" into "out", in blocks of "block_size"
+// bytes, using up to "threads" threads (0 = one per core).
+inline void compress(ByteVec &out, uint8_t const *data, size_t size, size_t block_size, int threads,
+    BlockBackend backend = kBackendAuto)
+{
+    out.clear();
+    VecSink sink(out);
+    ContainerWriter writer(sink, block_size, threads, backend);
+    writer.add_data(data, size);
+    writer.finish();
+}
+
+// Output size that's enough to compress "size" bytes in blocks of
+// "block_size", for writing into a fixed buffer (see BufferSink).
+// Incompressible data comes out about 1% larger with the adaptive
+// backends, and rANS adds up to a few hundred bytes of table per block;
+// this leaves plenty of room on top of both.
+inline size_t compress_bound(size_t size, size_t block_size)
+{
+    size_t num_blocks = (size + block_size - 1) / block_size;
+    return size + size / 16 + num_blocks * (1024 + kSeekEntrySize) + kContainerHeaderSize + kContainerFooterSize;
+}
+
+// Decode blocks [first, first + count) of a parsed container at "data"
+// into "out", which is where block "first" goes; the others follow it
+// back to back.
+inline DecodeStatus decode_blocks(uint8_t *out, BlockIndex const &index, uint8_t const *data,
+    size_t first, size_t count, int threads)
+{
+    DecodeStatusFlag result;
+    size_t base = index.raw_begin(first);
+
+    parallel_for(count, threads, [&](size_t i)
+    {
+        if (!result.failed())
+            result.report(decode_indexed_block(out + index.raw_begin(first + i) - base, index, data, first + i));
+    });
+
+    return result.get();
+}
+
+// Most bytes of output to decode per batch into a buffer of our own.
+static size_t const kDecodeBatchBytes = 64 << 20;
+
+// Blocks per batch when decoding into our own buffer: enough to keep
+// all threads busy, but no more than fit in kDecodeBatchBytes unless
+// that's less than one per thread. (A header claiming huge blocks is
+// all it takes to make them huge.)
+inline size_t decode_batch_blocks(BlockIndex const &index, int threads)
+{
+    size_t stride = index.max_raw_len() ? index.max_raw_len() : 1;
+    size_t batch = (size_t)threads * 4;
+    size_t fit = kDecodeBatchBytes / stride;
+    if (batch > fit)
+        batch = fit > (size_t)threads ? fit : (size_t)threads;
+    return batch;
+}
+
+// Decompress all of "data" into "out", using up to "threads" threads
+// (0 = one per core). Fails with kDecodeTooLarge if the output would be
+// bigger than "max_output". The header says how big the output is, but
+// it can lie, so "out" grows a batch at a time, as blocks decode.
+inline DecodeStatus try_decompress(ByteVec &out, uint8_t const *data, size_t size, int threads,
+    uint64_t max_output = kDefaultMaxOutput)
+{
+    BlockIndex index;
+    DecodeStatus status = index.parse(data, size);
+    if (status != kDecodeOk)
+        return status;
+    if (index.raw_size > max_output)
+        return kDecodeTooLarge;
+
+    threads = resolve_threads(threads);
+    size_t num_blocks = index.num_blocks();
+    size_t batch = decode_batch_blocks(index, threads);
+    out.clear();
+
+    for (size_t first = 0; first < num_blocks; first += batch)
+    {
+        size_t count = num_blocks - first < batch ? num_blocks - first : batch;
+        try
+        {
+            out.resize(index.raw_begin(first + count - 1) + index.raw_len(first + count - 1));
+        }
+        catch (std::bad_alloc const &)
+        {
+            return kDecodeOutOfMemory;
+        }
+
+        status = decode_blocks(&out[0] + index.raw_begin(first), index, data, first, count, threads);
+        if (status != kDecodeOk)
+            return status;
+    }
+
+    return kDecodeOk;
+}
+
+// Short for try_decompress with the default limit; returns false on any error.
+inline bool decompress(ByteVec &out, uint8_t const *data, size_t size, int threads)
+{
+    return try_decompress(out, data, size, threads) == kDecodeOk;
+}
+
+// Same, but writing to a sink, a batch of blocks at a time, so the
+// output never needs to be in memory all at once. Bytes written before
+// an error was found stay written.
+inline DecodeStatus try_decompress(ByteSink &out, uint8_t const *data, size_t size, int threads,
+    uint64_t max_output = kDefaultMaxOutput)
+{
+    BlockIndex index;
+    DecodeStatus status = index.parse(data, size);
+    if (status != kDecodeOk)
+        return status;
+    if (index.raw_size > max_output)
+        return kDecodeTooLarge;
+
+    threads = resolve_threads(threads);
+    size_t num_blocks = index.num_blocks();
+    size_t batch = decode_batch_blocks(index, threads);
+    ByteVec buf;
+    try
+    {
+        buf.resize((num_blocks < batch ? num_blocks : batch) * index.max_raw_len());
+    }
+    catch (std::bad_alloc const &)
+    {
+        return kDecodeOutOfMemory;
+    }
+
+    for (size_t first = 0; first < num_blocks; first += batch)
+    {
+        size_t count = num_blocks - first < batch ? num_blocks - first : batch;
+        status = decode_blocks(&buf[0], index, data, first, count, threads);
+        if (status != kDecodeOk)
+            break;
+
+        // All blocks but the last are full-size, so the batch is contiguous.
+        size_t len = index.raw_begin(first + count - 1) + index.raw_len(first + count - 1) - index.raw_begin(first);
+        out.write(&buf[0], len);
+    }
+
+    out.flush();
+    return status;
+}
+
+// Decompress just block number "block" of "data" into "out". Returns
+// false if the data is corrupt or there's no such block.
+inline bool decompress_block(ByteVec &out, uint8_t const *data, size_t size, size_t block)
+{
+    BlockIndex index;
+    if (index.parse(data, size) != kDecodeOk || block >= index.num_blocks())
+        return false;
+
+    out.resize(index.raw_len(block));
+    return decode_indexed_block(out.empty() ? 0 : &out[0], index, data, block) == kDecodeOk;
+}
+
+
+} // namespace mini_arith
+
+#endif // MINI_ARITH_H
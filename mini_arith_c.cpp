@@ -0,0 +1,150 @@
+// Simple byte-aligned binary arithmetic coder - public domain - Fabian 'ryg' Giesen 2015
+//
+// C interface (see mini_arith_c.h). Thin wrappers around the container
+// functions in mini_arith.h; the only real work here is keeping the
+// scratch memory around between calls, and making sure no C++
+// exceptions (running out of memory, or of threads) get out to a C
+// caller. Decoding also handles that in worker threads; compressing
+// with more than one thread doesn't, and a worker running out of
+// memory there is fatal.
+
+#include "mini_arith.h"
+#include "mini_arith_c.h"
+
+using namespace mini_arith;
+
+// The C status codes are DecodeStatus plus a few more.
+typedef char c_status_matches_decode_status[
+    MINI_ARITH_OK == (int)kDecodeOk && MINI_ARITH_TRUNCATED == (int)kDecodeTruncated &&
+    MINI_ARITH_BAD_HEADER == (int)kDecodeBadHeader && MINI_ARITH_TOO_LARGE == (int)kDecodeTooLarge &&
+    MINI_ARITH_CORRUPT == (int)kDecodeCorrupt && MINI_ARITH_BAD_CHECKSUM == (int)kDecodeBadChecksum &&
+    MINI_ARITH_OUT_OF_MEMORY == (int)kDecodeOutOfMemory ? 1 : -1];
+
+struct mini_arith_ctx
+{
+    // The writer stays bound to the sink for the life of the context;
+    // each compress call points the sink at the caller's buffer and
+    // restarts the writer, which keeps its per-block buffers.
+    BufferSink sink;
+    ContainerWriter writer;
+    BlockIndex index; // seek table, reused across decompress calls
+    int threads;
+
+    mini_arith_ctx(size_t block_size, int threads, BlockBackend backend)
+        : sink(0, 0), writer(sink, block_size, threads, backend), threads(threads)
+    {
+    }
+
+private:
+    // noncopyable
+    mini_arith_ctx(mini_arith_ctx const &);
+    mini_arith_ctx &operator =(mini_arith_ctx const &);
+};
+
+extern "C" mini_arith_ctx *mini_arith_ctx_create(size_t block_size, int threads, int backend)
+{
+    if (block_size == 0 || block_size > kMaxBlockSize)
+        return 0;
+    if (backend != kBackendArith && backend != kBackendRans && backend != kBackendLz && backend != kBackendAuto)
+        return 0;
+
+    try
+    {
+        return new mini_arith_ctx(block_size, threads, (BlockBackend)backend);
+    }
+    catch (...)
+    {
+        return 0;
+    }
+}
+
+extern "C" void mini_arith_ctx_free(mini_arith_ctx *ctx)
+{
+    delete ctx;
+}
+
+extern "C" size_t mini_arith_compress_bound(size_t src_size, size_t block_size)
+{
+    return compress_bound(src_size, block_size ? block_size : 1);
+}
+
+extern "C" int mini_arith_compress(mini_arith_ctx *ctx, void *dst, size_t dst_capacity, size_t *dst_size,
+    void const *src, size_t src_size)
+{
+    if (!ctx || !dst_size || (!dst && dst_capacity) || (!src && src_size))
+        return MINI_ARITH_BAD_ARGUMENT;
+
+    try
+    {
+        ctx->sink.reset((uint8_t *)dst, dst_capacity);
+        ctx->writer.restart();
+        ctx->writer.add_data((uint8_t const *)src, src_size);
+        ctx->writer.finish();
+    }
+    catch (...)
+    {
+        return MINI_ARITH_OUT_OF_MEMORY;
+    }
+
+    *dst_size = ctx->sink.needed_size();
+    return ctx->sink.overflowed() ? MINI_ARITH_DST_TOO_SMALL : MINI_ARITH_OK;
+}
+
+extern "C" int mini_arith_decompressed_size(mini_arith_ctx *ctx, void const *src, size_t src_size, uint64_t *size)
+{
+    if (!ctx || !size || (!src && src_size))
+        return MINI_ARITH_BAD_ARGUMENT;
+
+    try
+    {
+        DecodeStatus status = ctx->index.parse((uint8_t const *)src, src_size);
+        if (status != kDecodeOk)
+            return status;
+    }
+    catch (...)
+    {
+        return MINI_ARITH_OUT_OF_MEMORY;
+    }
+
+    *size = ctx->index.raw_size;
+    return MINI_ARITH_OK;
+}
+
+extern "C" int mini_arith_decompress(mini_arith_ctx *ctx, void *dst, size_t dst_capacity, size_t *dst_size,
+    void const *src, size_t src_size)
+{
+    if (!ctx || !dst_size || (!dst && dst_capacity) || (!src && src_size))
+        return MINI_ARITH_BAD_ARGUMENT;
+
+    try
+    {
+        BlockIndex &index = ctx->index;
+        DecodeStatus status = index.parse((uint8_t const *)src, src_size);
+        if (status != kDecodeOk)
+            return status;
+
+        // parse() made sure raw_size fits in a size_t.
+        *dst_size = (size_t)index.raw_size;
+        if (index.raw_size > dst_capacity)
+            return MINI_ARITH_DST_TOO_SMALL;
+
+        return decode_blocks((uint8_t *)dst, index, (uint8_t const *)src, 0, index.num_blocks(), ctx->threads);
+    }
+    catch (...)
+    {
+        return MINI_ARITH_OUT_OF_MEMORY;
+    }
+}
+
+extern "C" char const *mini_arith_status_name(int status)
+{
+    switch (status)
+    {
+    case MINI_ARITH_DST_TOO_SMALL: return "output buffer too small";
+    case MINI_ARITH_BAD_ARGUMENT:  return "bad argument";
+    }
+
+    if (status < MINI_ARITH_OK || status > MINI_ARITH_OUT_OF_MEMORY)
+        return "unknown error";
+    return decode_status_name((DecodeStatus)status);
+}
@@ -0,0 +1,97 @@
+/* Simple byte-aligned binary arithmetic coder - public domain - Fabian 'ryg' Giesen 2015
+ *
+ * Plain C interface to the block container (see mini_arith.h), for
+ * calling from other languages. Everything works on caller-provided
+ * buffers: nothing allocated in here ever needs to be freed by the
+ * caller, except the context itself.
+ *
+ * A context holds the settings and the scratch memory for compressing
+ * and decompressing. Create one per thread and keep it around; after
+ * the first few calls, its buffers are big enough and get reused.
+ * A context must not be used by two threads at the same time.
+ *
+ * Typical use:
+ *
+ *   mini_arith_ctx *ctx = mini_arith_ctx_create(1 << 20, 1, MINI_ARITH_BACKEND_AUTO);
+ *   size_t cap = mini_arith_compress_bound(src_size, 1 << 20), size;
+ *   int status = mini_arith_compress(ctx, dst, cap, &size, src, src_size);
+ *   ...
+ *   mini_arith_ctx_free(ctx);
+ */
+
+#ifndef MINI_ARITH_C_H
+#define MINI_ARITH_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Result of a call. The values up to MINI_ARITH_OUT_OF_MEMORY are the
+ * same as the C++ DecodeStatus; these numbers won't change. */
+enum mini_arith_status
+{
+    MINI_ARITH_OK = 0,
+    MINI_ARITH_TRUNCATED = 1,       /* too short to be a container */
+    MINI_ARITH_BAD_HEADER = 2,      /* not a container, unsupported version, or bad seek table */
+    MINI_ARITH_TOO_LARGE = 3,       /* (not returned here; see MINI_ARITH_DST_TOO_SMALL) */
+    MINI_ARITH_CORRUPT = 4,         /* a block didn't decode */
+    MINI_ARITH_BAD_CHECKSUM = 5,    /* a block decoded, but to the wrong data */
+    MINI_ARITH_OUT_OF_MEMORY = 6,
+    MINI_ARITH_DST_TOO_SMALL = 7,   /* output didn't fit; *dst_size says how much is needed */
+    MINI_ARITH_BAD_ARGUMENT = 8     /* null pointer where there can't be one */
+};
+
+/* How blocks get coded; see BlockBackend. */
+enum mini_arith_backend
+{
+    MINI_ARITH_BACKEND_ARITH = 0,   /* adaptive order-0 bit tree */
+    MINI_ARITH_BACKEND_RANS = 1,    /* static order-0 rANS */
+    MINI_ARITH_BACKEND_LZ = 2,      /* LZ77 with binary models */
+    MINI_ARITH_BACKEND_AUTO = 255   /* pick per block, arith or rANS */
+};
+
+typedef struct mini_arith_ctx mini_arith_ctx;
+
+/* Make a context that compresses in blocks of "block_size" bytes (1 to
+ * 64 MB) with "backend", using up to "threads" threads for both
+ * compressing and decompressing (0 = one per core). Returns NULL on
+ * bad arguments or when out of memory. */
+mini_arith_ctx *mini_arith_ctx_create(size_t block_size, int threads, int backend);
+void mini_arith_ctx_free(mini_arith_ctx *ctx);
+
+/* Output buffer size that's enough to compress "src_size" bytes in
+ * blocks of "block_size" bytes. Generous: incompressible data grows by
+ * a bit over 1%. */
+size_t mini_arith_compress_bound(size_t src_size, size_t block_size);
+
+/* Compress "src_size" bytes at "src" into "dst", which has room for
+ * "dst_capacity" bytes, and store the compressed size in *dst_size.
+ * If it doesn't fit, returns MINI_ARITH_DST_TOO_SMALL with the size
+ * that would've been needed in *dst_size. */
+int mini_arith_compress(mini_arith_ctx *ctx, void *dst, size_t dst_capacity, size_t *dst_size,
+    void const *src, size_t src_size);
+
+/* Get the uncompressed size of the container at "src", from its footer.
+ * Does not decode (or check) the blocks. */
+int mini_arith_decompressed_size(mini_arith_ctx *ctx, void const *src, size_t src_size, uint64_t *size);
+
+/* Decompress the container at "src" into "dst", which has room for
+ * "dst_capacity" bytes, and store the uncompressed size in *dst_size.
+ * If it doesn't fit, nothing gets decoded, and the result is
+ * MINI_ARITH_DST_TOO_SMALL with the size needed in *dst_size. Safe on
+ * untrusted input. On errors other than that, the contents of "dst"
+ * are unspecified. */
+int mini_arith_decompress(mini_arith_ctx *ctx, void *dst, size_t dst_capacity, size_t *dst_size,
+    void const *src, size_t src_size);
+
+/* Human-readable description of a status code. */
+char const *mini_arith_status_name(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MINI_ARITH_C_H */
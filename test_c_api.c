@@ -0,0 +1,153 @@
+/* Simple byte-aligned binary arithmetic coder - public domain - Fabian 'ryg' Giesen 2015
+ *
+ * Tests for the C interface (mini_arith_c.h), in plain C99, linked
+ * against libmini_arith.a like an outside user would. "make check"
+ * runs it.
+ */
+
+#include "mini_arith_c.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+static void check(int ok, char const *what, int backend)
+{
+    if (!ok)
+    {
+        printf("FAILED: %s (backend %d)\n", what, backend);
+        ++failures;
+    }
+}
+
+/* Something compressible, but not trivially so: words from a small
+ * vocabulary, with the odd random byte mixed in. */
+static void make_input(unsigned char *buf, size_t size)
+{
+    static char const *const words[8] = { "the ", "coder ", "model ", "bit ", "range ", "block ", "of ", "and " };
+    uint32_t seed = 1;
+    size_t pos = 0;
+    while (pos < size)
+    {
+        char const *word;
+        size_t len;
+
+        seed = seed * 1664525 + 1013904223;
+        if ((seed >> 28) == 0)
+        {
+            buf[pos++] = (unsigned char)(seed >> 8);
+            continue;
+        }
+
+        word = words[(seed >> 16) & 7];
+        len = strlen(word);
+        if (len > size - pos)
+            len = size - pos;
+        memcpy(buf + pos, word, len);
+        pos += len;
+    }
+}
+
+static void test_backend(int backend, unsigned char const *src, size_t src_size)
+{
+    size_t const block_size = 16384;
+    size_t cap = mini_arith_compress_bound(src_size, block_size);
+    unsigned char *coded = (unsigned char *)malloc(cap);
+    unsigned char *decoded = (unsigned char *)malloc(src_size);
+    size_t coded_size = 0, decoded_size = 0, needed = 0;
+    uint64_t raw_size = 0;
+    int status, round;
+
+    mini_arith_ctx *ctx = mini_arith_ctx_create(block_size, 1, backend);
+    check(ctx != NULL, "create", backend);
+    if (!ctx || !coded || !decoded)
+    {
+        free(coded);
+        free(decoded);
+        mini_arith_ctx_free(ctx);
+        return;
+    }
+
+    /* Round trip, a few times over with the same context. */
+    for (round = 0; round < 3; ++round)
+    {
+        status = mini_arith_compress(ctx, coded, cap, &coded_size, src, src_size);
+        check(status == MINI_ARITH_OK && coded_size < src_size, "compress", backend);
+
+        status = mini_arith_decompressed_size(ctx, coded, coded_size, &raw_size);
+        check(status == MINI_ARITH_OK && raw_size == src_size, "decompressed_size", backend);
+
+        memset(decoded, 0, src_size);
+        status = mini_arith_decompress(ctx, decoded, src_size, &decoded_size, coded, coded_size);
+        check(status == MINI_ARITH_OK && decoded_size == src_size && memcmp(decoded, src, src_size) == 0,
+            "round trip", backend);
+    }
+
+    /* Output buffers too small: both report what they would've needed. */
+    status = mini_arith_compress(ctx, coded, coded_size - 1, &needed, src, src_size);
+    check(status == MINI_ARITH_DST_TOO_SMALL && needed == coded_size, "compress into small buffer", backend);
+    status = mini_arith_compress(ctx, NULL, 0, &needed, src, src_size);
+    check(status == MINI_ARITH_DST_TOO_SMALL && needed == coded_size, "compress size query", backend);
+
+    /* (That left "coded" partly overwritten; redo it.) */
+    status = mini_arith_compress(ctx, coded, cap, &coded_size, src, src_size);
+    check(status == MINI_ARITH_OK, "compress again", backend);
+
+    status = mini_arith_decompress(ctx, decoded, src_size - 1, &needed, coded, coded_size);
+    check(status == MINI_ARITH_DST_TOO_SMALL && needed == src_size, "decompress into small buffer", backend);
+
+    /* Truncated input */
+    status = mini_arith_decompress(ctx, decoded, src_size, &decoded_size, coded, 10);
+    check(status == MINI_ARITH_TRUNCATED, "truncated", backend);
+    status = mini_arith_decompress(ctx, decoded, src_size, &decoded_size, coded, coded_size - 1);
+    check(status == MINI_ARITH_BAD_HEADER, "cut off", backend);
+
+    /* Damaged block: must not come back as OK. */
+    coded[coded_size / 2] ^= 0x10;
+    status = mini_arith_decompress(ctx, decoded, src_size, &decoded_size, coded, coded_size);
+    check(status == MINI_ARITH_CORRUPT || status == MINI_ARITH_BAD_CHECKSUM, "corrupt", backend);
+
+    /* Empty input */
+    status = mini_arith_compress(ctx, coded, cap, &coded_size, src, 0);
+    check(status == MINI_ARITH_OK, "compress empty", backend);
+    decoded_size = 1;
+    status = mini_arith_decompress(ctx, NULL, 0, &decoded_size, coded, coded_size);
+    check(status == MINI_ARITH_OK && decoded_size == 0, "decompress empty", backend);
+
+    mini_arith_ctx_free(ctx);
+    free(coded);
+    free(decoded);
+}
+
+int main(void)
+{
+    static int const backends[4] =
+    {
+        MINI_ARITH_BACKEND_ARITH, MINI_ARITH_BACKEND_RANS, MINI_ARITH_BACKEND_LZ, MINI_ARITH_BACKEND_AUTO
+    };
+    size_t const src_size = 100000;
+    unsigned char *src = (unsigned char *)malloc(src_size);
+    size_t dummy;
+    int i;
+
+    if (!src)
+        return 1;
+    make_input(src, src_size);
+
+    for (i = 0; i < 4; ++i)
+        test_backend(backends[i], src, src_size);
+
+    /* Bad arguments */
+    check(mini_arith_ctx_create(0, 1, MINI_ARITH_BACKEND_AUTO) == NULL, "zero block size", -1);
+    check(mini_arith_ctx_create(4096, 1, 7) == NULL, "unknown backend", -1);
+    check(mini_arith_compress(NULL, NULL, 0, &dummy, src, src_size) == MINI_ARITH_BAD_ARGUMENT, "null context", -1);
+    check(strcmp(mini_arith_status_name(MINI_ARITH_CORRUPT), "corrupt block") == 0, "status name", -1);
+
+    free(src);
+    if (failures)
+        return 1;
+    printf("C API ok!\n");
+    return 0;
+}